@@ -0,0 +1,209 @@
+/*
+ * arena.c - a region allocator for memory that is freed all at once,
+ *           such as everything one request allocates.
+ *
+ *           An arena bumps a pointer through chunks it gets from mem_sbrk
+ *           or from mm_malloc. Objects are never freed one by one:
+ *           arena_reset makes all of the arena's memory reusable and
+ *           arena_destroy gives it up, neither of them visiting the
+ *           objects. An arena is not thread-safe; each request owns one.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "memlib.h"
+#include "mm.h"
+
+#define ARENA_ALIGN 8      /* payloads are aligned like mm_malloc's */
+#define ARENA_CHUNK 4096   /* chunk size used when the caller passes 0 */
+
+/* rounds up to the nearest multiple of ARENA_ALIGN */
+#define ARENA_ROUND(size) (((size) + (ARENA_ALIGN-1)) & ~(size_t)(ARENA_ALIGN-1))
+
+/* header at the start of every chunk */
+typedef struct chunk {
+    struct chunk *next;    /* next chunk on the used or spare list */
+    size_t size;           /* bytes in the chunk, header included */
+} chunk_t;
+
+/* the arena itself lives at the start of its first chunk */
+struct arena {
+    char *ptr;             /* next free byte in the current chunk */
+    char *end;             /* end of the current chunk */
+    char *last;            /* most recent allocation, which realloc can grow */
+    chunk_t *first;        /* chunk holding this struct, on no list */
+    chunk_t *used;         /* chunks taken since the last reset, newest first */
+    chunk_t *used_tail;    /* oldest of them, so the list moves in O(1) */
+    chunk_t *spare;        /* chunks a reset made available again */
+    size_t chunk_size;     /* size of a new chunk, unless a request needs more */
+    size_t footprint;      /* bytes in all of the arena's chunks */
+    int source;            /* ARENA_FROM_SBRK or ARENA_FROM_MM */
+};
+
+static chunk_t *new_chunk(int source, size_t size);
+static int arena_grow(arena_t *a, size_t size);
+
+/*
+ * arena_create - make an empty arena that takes chunk_size bytes at a
+ *     time from source. Returns NULL if the first chunk can't be had.
+ */
+arena_t *arena_create(size_t chunk_size, int source)
+{
+    size_t head = sizeof(chunk_t) + ARENA_ROUND(sizeof(arena_t));
+    chunk_t *c;
+    arena_t *a;
+
+    if (chunk_size == 0)
+        chunk_size = ARENA_CHUNK;
+    chunk_size = ARENA_ROUND(chunk_size);
+    if (chunk_size < head + ARENA_ALIGN)
+        chunk_size = head + ARENA_ALIGN;
+    if ((c = new_chunk(source, chunk_size)) == NULL)
+        return NULL;
+
+    a = (arena_t *)(c + 1);
+    a->first = c;
+    a->used = a->used_tail = a->spare = NULL;
+    a->chunk_size = chunk_size;
+    a->footprint = chunk_size;
+    a->source = source;
+    arena_reset(a);
+    return a;
+}
+
+/*
+ * arena_alloc - bump-allocate size bytes, starting a new chunk when the
+ *     current one is full. Returns NULL if no chunk can be had.
+ */
+void *arena_alloc(arena_t *a, size_t size)
+{
+    size = ARENA_ROUND(size ? size : 1);
+    if ((size_t)(a->end - a->ptr) < size && arena_grow(a, size) < 0)
+        return NULL;
+    a->last = a->ptr;
+    a->ptr += size;
+    return a->last;
+}
+
+/*
+ * arena_realloc - resize the old_size bytes at ptr to size bytes. The
+ *     latest allocation is resized in place while its chunk has room;
+ *     anything else that grows is copied to a new allocation, and the
+ *     old one is only reclaimed by a reset.
+ */
+void *arena_realloc(arena_t *a, void *ptr, size_t old_size, size_t size)
+{
+    void *newp;
+
+    if (ptr == NULL)
+        return arena_alloc(a, size);
+    if (ptr == a->last && (size_t)(a->end - a->last) >= ARENA_ROUND(size)) {
+        a->ptr = a->last + ARENA_ROUND(size ? size : 1);
+        return ptr;
+    }
+    if (size <= old_size)
+        return ptr;
+    if ((newp = arena_alloc(a, size)) == NULL)
+        return NULL;
+    memcpy(newp, ptr, old_size);
+    return newp;
+}
+
+/*
+ * arena_reset - make all of the arena's memory available again. The
+ *     chunks stay with the arena for later allocations.
+ */
+void arena_reset(arena_t *a)
+{
+    if (a->used != NULL) {
+        a->used_tail->next = a->spare;
+        a->spare = a->used;
+        a->used = a->used_tail = NULL;
+    }
+    a->ptr = (char *)a->first + sizeof(chunk_t) + ARENA_ROUND(sizeof(arena_t));
+    a->end = (char *)a->first + a->first->size;
+    a->last = NULL;
+}
+
+/*
+ * arena_destroy - give up the arena and everything allocated from it.
+ *     Chunks from mm_malloc go back with one mm_free each; the heap has
+ *     no way to take back chunks from mem_sbrk, which stay in place
+ *     until the next mem_reset_brk.
+ */
+void arena_destroy(arena_t *a)
+{
+    chunk_t *lists[2], *c, *next;
+    int i;
+
+    if (a->source != ARENA_FROM_MM)
+        return;
+    lists[0] = a->used;
+    lists[1] = a->spare;
+    for (i = 0; i < 2; i++) {
+        for (c = lists[i]; c != NULL; c = next) {
+            next = c->next;
+            mm_free(c);
+        }
+    }
+    mm_free(a->first);
+}
+
+/*
+ * arena_footprint - bytes in all of the arena's chunks
+ */
+size_t arena_footprint(arena_t *a)
+{
+    return a->footprint;
+}
+
+/*
+ * new_chunk - get a chunk of size bytes from source
+ */
+static chunk_t *new_chunk(int source, size_t size)
+{
+    chunk_t *c;
+
+    if (source == ARENA_FROM_MM)
+        c = mm_malloc(size);
+    else if ((c = mem_sbrk(size)) == (void *)-1)
+        c = NULL;
+    if (c != NULL) {
+        c->next = NULL;
+        c->size = size;
+    }
+    return c;
+}
+
+/*
+ * arena_grow - make a chunk with room for size bytes current, reusing
+ *     the first spare one that is big enough. Spares come back in the
+ *     order they were taken, so a repeated request pattern usually finds
+ *     one at the head. Returns -1 if no chunk can be had.
+ */
+static int arena_grow(arena_t *a, size_t size)
+{
+    size_t need = sizeof(chunk_t) + size;
+    chunk_t **prevp = &a->spare;
+    chunk_t *c;
+
+    while ((c = *prevp) != NULL && c->size < need)
+        prevp = &c->next;
+    if (c != NULL) {
+        *prevp = c->next;
+    }
+    else {
+        if ((c = new_chunk(a->source, need > a->chunk_size ? need : a->chunk_size)) == NULL)
+            return -1;
+        a->footprint += c->size;
+    }
+
+    c->next = a->used;
+    if (a->used == NULL)
+        a->used_tail = c;
+    a->used = c;
+    a->ptr = (char *)(c + 1);
+    a->end = (char *)c + c->size;
+    return 0;
+}
@@ -0,0 +1,14 @@
+#include <stddef.h>
+
+/* where an arena gets its chunks from */
+#define ARENA_FROM_SBRK 0  /* mem_sbrk; only while nothing else grows the heap */
+#define ARENA_FROM_MM   1  /* mm_malloc, so the arena can share the heap with mm */
+
+typedef struct arena arena_t;
+
+arena_t *arena_create(size_t chunk_size, int source);
+void *arena_alloc(arena_t *a, size_t size);
+void *arena_realloc(arena_t *a, void *ptr, size_t old_size, size_t size);
+void arena_reset(arena_t *a);
+void arena_destroy(arena_t *a);
+size_t arena_footprint(arena_t *a);
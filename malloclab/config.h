@@ -58,15 +58,26 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes (can be overridden with -DMAX_HEAP=...)
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
+
+/*
+ * Set to 1 to back the simulated heap with a reserved mmap region instead
+ * of a malloc'd array. Only then does mem_release hand pages back to the OS.
+ */
+#ifndef USE_MMAP_HEAP
+#define USE_MMAP_HEAP 0
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_SAMPLE 1   /* median of samples on rdtscp or CLOCK_MONOTONIC_RAW */
 
 #endif /* __CONFIG_H */
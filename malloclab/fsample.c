@@ -0,0 +1,162 @@
+/*
+ * fsample.c - Estimate the running time (in seconds) of a function f
+ *     from repeated samples, and how far that estimate can be trusted.
+ *
+ *     Samples are timed with rdtscp when the CPU has an invariant TSC,
+ *     whose rate is calibrated against CLOCK_MONOTONIC_RAW, and with
+ *     CLOCK_MONOTONIC_RAW itself otherwise. f is first run until it
+ *     stops getting faster (cold caches, page faults), then enough
+ *     times per sample that the clock's resolution doesn't matter.
+ *     Sampling goes on until the 95% confidence interval of the median
+ *     is within FSAMPLE_PRECISION of it, or until FSAMPLE_BUDGET
+ *     seconds have been spent. The interval comes from the order
+ *     statistics of the samples, so it assumes nothing about their
+ *     distribution.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#include "fsample.h"
+
+#ifndef FSAMPLE_PRECISION
+#define FSAMPLE_PRECISION 0.01  /* target CI half-width, relative to the median */
+#endif
+#ifndef FSAMPLE_BUDGET
+#define FSAMPLE_BUDGET 0.25     /* most seconds spent sampling one function */
+#endif
+#define MIN_SAMPLE  200e-6      /* shortest sample, in seconds */
+#define MIN_SAMPLES 7           /* samples before the interval is trusted */
+#define MAX_SAMPLES 200         /* samples kept */
+#define MAX_WARMUPS 10          /* calls of f spent getting it warm */
+#define CALIBRATE   0.02        /* seconds spent calibrating the TSC */
+
+static double tsc_hz = 0;       /* TSC ticks per second, 0 if not used */
+
+static double now(void);
+static double mono_raw(void);
+static int compare_doubles(const void *a, const void *b);
+
+/*
+ * init_fsample - use the TSC if it ticks at a constant rate, measuring
+ *     that rate against CLOCK_MONOTONIC_RAW
+ */
+void init_fsample(int verbose)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx, aux;
+    unsigned long long t0;
+    double s0, s;
+
+    /* CPUID 0x80000007, EDX bit 8: the TSC is invariant */
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8))) {
+        s0 = mono_raw();
+        t0 = __rdtscp(&aux);
+        while ((s = mono_raw()) - s0 < CALIBRATE)
+            ;
+        tsc_hz = (__rdtscp(&aux) - t0) / (s - s0);
+    }
+#endif
+    if (verbose) {
+        if (tsc_hz > 0)
+            printf("Measuring performance with rdtscp (%.0f MHz TSC), "
+                   "median of samples.\n", tsc_hz / 1e6);
+        else
+            printf("Measuring performance with CLOCK_MONOTONIC_RAW, "
+                   "median of samples.\n");
+    }
+}
+
+/*
+ * fsample - Return the median running time of f(argp), filling in st
+ *     (if not NULL) with the rest of what the samples showed
+ */
+double fsample(fsample_test_funct f, void *argp, fsample_t *st)
+{
+    double samples[MAX_SAMPLES], sorted[MAX_SAMPLES];
+    double start, t, best, median = 0, lo = 0, hi = 0, half;
+    int n, reps, warmups, i, j, k;
+
+    /* Warm up until a run is no longer clearly faster than the best */
+    start = now();
+    f(argp);
+    best = now() - start;
+    for (warmups = 1; warmups < MAX_WARMUPS; warmups++) {
+        t = now();
+        f(argp);
+        t = now() - t;
+        if (t > best * 0.98)
+            break;
+        best = t;
+    }
+
+    /* Time enough calls together that the clock's resolution is noise */
+    reps = (best > 0 && best < MIN_SAMPLE) ? (int)ceil(MIN_SAMPLE / best) : 1;
+
+    for (n = 0; n < MAX_SAMPLES; ) {
+        t = now();
+        for (i = 0; i < reps; i++)
+            f(argp);
+        samples[n++] = (now() - t) / reps;
+
+        if (n < MIN_SAMPLES)
+            continue;
+
+        /* The median's 95% interval runs between these ranks */
+        for (i = 0; i < n; i++)
+            sorted[i] = samples[i];
+        qsort(sorted, n, sizeof(double), compare_doubles);
+        half = 1.96 * sqrt(n) / 2;
+        j = (int)floor(n / 2.0 - half);
+        k = (int)ceil(n / 2.0 + half);
+        lo = sorted[j < 0 ? 0 : j];
+        hi = sorted[k > n - 1 ? n - 1 : k];
+        median = (n % 2) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+        if ((hi - lo) / 2 <= FSAMPLE_PRECISION * median ||
+            now() - start > FSAMPLE_BUDGET)
+            break;
+    }
+    if (st != NULL) {
+        st->median = median;
+        st->p95 = sorted[(int)ceil(0.95 * n) - 1];
+        st->lo = lo;
+        st->hi = hi;
+        st->samples = n;
+        st->reps = reps;
+        st->warmups = warmups;
+    }
+    return median;
+}
+
+/*
+ * now - seconds on the best clock there is
+ */
+static double now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int aux;
+
+    if (tsc_hz > 0)
+        return __rdtscp(&aux) / tsc_hz;
+#endif
+    return mono_raw();
+}
+
+static double mono_raw(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
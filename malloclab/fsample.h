@@ -0,0 +1,21 @@
+/*
+ * fsample.h - time a function from many samples and summarize them
+ */
+typedef void (*fsample_test_funct)(void *);
+
+/* What fsample learned about the running time of f(argp), in seconds */
+typedef struct {
+    double median;   /* median sample */
+    double p95;      /* 95th percentile sample */
+    double lo, hi;   /* 95% confidence interval of the median */
+    int samples;     /* samples taken */
+    int reps;        /* calls of f timed together as one sample */
+    int warmups;     /* calls of f before sampling began */
+} fsample_t;
+
+/* Pick a clock (rdtscp if it can be calibrated) and report it if verbose */
+void init_fsample(int verbose);
+
+/* Sample f(argp) until its median is known to within FSAMPLE_PRECISION
+   or the time budget runs out, and return the median */
+double fsample(fsample_test_funct f, void *argp, fsample_t *st);
@@ -6,9 +6,11 @@
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
+#include "fsample.h"
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static fsample_t last; /* the samples behind the last fsecs */
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -36,6 +38,8 @@ void init_fsecs(void)
 #elif USE_GETTOD
     if (verbose)
 	printf("Measuring performance with gettimeofday().\n");
+#elif USE_SAMPLE
+    init_fsample(verbose);
 #endif
 }
 
@@ -46,12 +50,27 @@ double fsecs(fsecs_test_funct f, void *argp)
 {
 #if USE_FCYC
     double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
+    last.median = cycles/(Mhz*1e6);
 #elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
+    last.median = ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
+    last.median = ftimer_gettod(f, argp, 10);
+#elif USE_SAMPLE
+    return fsample(f, argp, &last);
 #endif 
+    last.p95 = last.lo = last.hi = last.median;
+    return last.median;
+}
+
+/*
+ * fsecs_spread - Return the 95th percentile and the 95% confidence
+ *     interval of the samples behind the last fsecs
+ */
+void fsecs_spread(double *p95, double *lo, double *hi)
+{
+    *p95 = last.p95;
+    *lo = last.lo;
+    *hi = last.hi;
 }
 
 
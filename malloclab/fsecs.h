@@ -2,3 +2,7 @@ typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+
+/* How spread out the samples behind the last fsecs were, in seconds.
+   Only USE_SAMPLE takes samples; the others report secs for all three. */
+void fsecs_spread(double *p95, double *lo, double *hi);
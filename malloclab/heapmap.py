@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+heapmap.py - Fragmentation timeline of the heap snapshots mdriver -H writes.
+
+For every snapshot of a .heap file it prints the heap size, the free
+bytes, the number of free runs (holes), the largest hole and
+1 - largest/free, followed by a histogram of the free bytes by hole
+size: one digit per size bucket, 0-9 tenths of the free bytes (+ for
+all of them). With --csv the same numbers, with the histogram in
+bytes, go to a file for plotting. With --map OP it draws the heap of
+the snapshot nearest request OP instead, one character per slice of
+the heap: '#' allocated, '.' free, and a digit for a slice holding
+both, giving how many tenths of it are free.
+
+    unix> mdriver -H /tmp/snap -I 100
+    unix> ./heapmap.py /tmp/snap-7.heap
+    unix> ./heapmap.py --buckets 64,256,1k,4k /tmp/snap-7.heap
+    unix> ./heapmap.py --map 6000 /tmp/snap-7.heap
+"""
+import argparse
+import bisect
+import csv
+import sys
+
+
+def read_snapshots(path):
+    """Return the header comment and [(label, heap bytes, runs)] of a file,
+    each run being (offset, bytes, allocated)."""
+    title, snaps = "", []
+    with open(path) as f:
+        for line in f:
+            words = line.split()
+            if not words:
+                continue
+            if words[0] == "#":
+                title = line[1:].strip()
+            elif words[0] == "snap":
+                snaps.append((int(words[1]), int(words[2]), []))
+            else:
+                snaps[-1][2].append((int(words[0]), int(words[1]), words[2] == "a"))
+    return title, snaps
+
+
+def size(text):
+    """Parse a byte count with an optional k or m suffix."""
+    text = text.strip().lower()
+    scale = {"k": 1 << 10, "m": 1 << 20}.get(text[-1:], 1)
+    return int(text.rstrip("km")) * scale
+
+
+def label(n):
+    """Print a bucket bound as compactly as it parses."""
+    for suffix, scale in (("m", 1 << 20), ("k", 1 << 10)):
+        if n >= scale and n % scale == 0:
+            return "%d%s" % (n // scale, suffix)
+    return str(n)
+
+
+def summarize(runs, bounds):
+    """Free bytes, holes, largest hole and free bytes per bucket."""
+    holes = [n for _, n, alloc in runs if not alloc]
+    free = sum(holes)
+    hist = [0] * (len(bounds) + 1)
+    for n in holes:
+        hist[bisect.bisect_right(bounds, n - 1)] += n
+    return free, len(holes), max(holes, default=0), hist
+
+
+def timeline(snaps, bounds, out):
+    names = ["<" + label(b) for b in bounds] + [">=" + label(bounds[-1])]
+    out.write("free bytes by hole size: %s\n" % " ".join(names))
+    out.write("%8s %10s %10s %6s %10s %6s  %s\n" % (
+        "request", "heap(KB)", "free(KB)", "holes", "max(KB)", "frag", "histogram"))
+    for op, heap, runs in snaps:
+        free, holes, largest, hist = summarize(runs, bounds)
+        frag = 1 - largest / free if free else 0.0
+        digits = "".join(
+            "+" if free and b == free else str(min(9, int(10 * b / free))) if free else "-"
+            for b in hist)
+        out.write("%8d %10.1f %10.1f %6d %10.1f %6.3f  %s\n" % (
+            op, heap / 1024, free / 1024, holes, largest / 1024, frag, digits))
+
+
+def write_csv(snaps, bounds, path):
+    with open(path, "w", newline="") as f:
+        w = csv.writer(f)
+        w.writerow(["request", "heap", "free", "holes", "largest", "fragmentation"]
+                   + ["lt_" + label(b) for b in bounds] + ["ge_" + label(bounds[-1])])
+        for op, heap, runs in snaps:
+            free, holes, largest, hist = summarize(runs, bounds)
+            frag = 1 - largest / free if free else 0.0
+            w.writerow([op, heap, free, holes, largest, "%.4f" % frag] + hist)
+
+
+def heap_map(snaps, op, width, rows, out):
+    """Draw the snapshot nearest request op, width x rows characters."""
+    op, heap, runs = min(snaps, key=lambda s: abs(s[0] - op))
+    if not runs:
+        out.write("request %d: empty heap\n" % op)
+        return
+    lo, hi = runs[0][0], runs[-1][0] + runs[-1][1]
+    cells = width * rows
+    step = max(1, -(-(hi - lo) // cells))
+    used = [0] * cells   # allocated and free bytes in each cell
+    free = [0] * cells
+    for start, n, alloc in runs:
+        pos, end = start - lo, start - lo + n
+        while pos < end:
+            cell = pos // step
+            take = min(end, (cell + 1) * step) - pos
+            (used if alloc else free)[cell] += take
+            pos += take
+    out.write("request %d: heap bytes %d to %d, %d bytes per character\n" % (
+        op, lo, hi, step))
+    line = []
+    for cell in range((hi - lo + step - 1) // step):
+        if used[cell] and free[cell]:
+            tenths = 10 * free[cell] // (used[cell] + free[cell])
+            line.append(str(min(9, max(1, tenths))))
+        else:
+            line.append("#" if used[cell] else ".")
+        if len(line) == width:
+            out.write("".join(line) + "\n")
+            line = []
+    if line:
+        out.write("".join(line) + "\n")
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    p.add_argument("file", help="heap snapshot file written by mdriver -H")
+    p.add_argument("--buckets", default="32,64,128,256,512,1k,2k,4k,16k,64k",
+                   help="upper bounds of the hole size buckets (default %(default)s)")
+    p.add_argument("--csv", metavar="FILE", help="also write the timeline to FILE")
+    p.add_argument("--map", metavar="OP", type=int,
+                   help="draw the heap at request OP instead of the timeline")
+    p.add_argument("--width", type=int, default=100, help="map characters per line")
+    p.add_argument("--rows", type=int, default=20, help="map lines")
+    args = p.parse_args()
+
+    bounds = sorted(size(b) for b in args.buckets.split(","))
+    title, snaps = read_snapshots(args.file)
+    if not snaps:
+        sys.exit("%s: no snapshots" % args.file)
+    if title:
+        print(title)
+    if args.map is not None:
+        heap_map(snaps, args.map, args.width, args.rows, sys.stdout)
+        return
+    timeline(snaps, bounds, sys.stdout)
+    if args.csv:
+        write_csv(snaps, bounds, args.csv)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,140 @@
+/*
+ * lathist.c - Histograms of single call latencies, bucketed the way
+ *     HdrHistogram does it: exact below LAT_SUB ticks, then a fixed
+ *     number of buckets per power of two, so any value lands in a
+ *     bucket within 1/64 of it and a histogram needs no sizing.
+ *
+ *     Timestamps are the TSC on x86, whose rate is measured against
+ *     CLOCK_MONOTONIC_RAW (it is assumed constant, as on any x86 of
+ *     the last decade), and CLOCK_MONOTONIC_RAW elsewhere. The least
+ *     a back-to-back pair of timestamps ever takes is the overhead of
+ *     timing a call; it is taken off every sample.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "lathist.h"
+
+#define CALIBRATE 0.02     /* seconds spent measuring the tick rate */
+#define PAIRS     10000    /* timestamp pairs that measure the overhead */
+
+static double tick_hz = 1e9;           /* ticks per second */
+static unsigned long long overhead;    /* ticks of a timestamp pair */
+
+static double mono_raw(void);
+
+/*
+ * init_lathist - measure the tick rate and the timestamp overhead
+ */
+void init_lathist(void)
+{
+    unsigned long long t0, t1, least;
+    double s0, s;
+    int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+    s0 = mono_raw();
+    t0 = lat_now();
+    while ((s = mono_raw()) - s0 < CALIBRATE)
+	;
+    tick_hz = (lat_now() - t0) / (s - s0);
+#endif
+    least = ~0ULL;
+    for (i = 0; i < PAIRS; i++) {
+	t0 = lat_now();
+	t1 = lat_now();
+	if (t1 - t0 < least)
+	    least = t1 - t0;
+    }
+    overhead = least;
+}
+
+double lathist_overhead(void)
+{
+    return overhead * 1e9 / tick_hz;
+}
+
+/*
+ * lathist_add - count a call from t0 to t1 in its bucket
+ */
+void lathist_add(lathist_t *h, unsigned long long t0, unsigned long long t1)
+{
+    unsigned long long v = t1 - t0;
+    int b, shift;
+
+    v = (v > overhead) ? v - overhead : 0;
+    if (v < LAT_SUB)
+	b = (int)v;
+    else {
+	/* keep the LAT_SUB_BITS-1 bits below the leading one */
+	shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS + 1;
+	b = LAT_SUB + (shift - 1) * (LAT_SUB / 2) +
+	    (int)(v >> shift) - LAT_SUB / 2;
+    }
+    h->buckets[b]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+	h->max = v;
+}
+
+/*
+ * bucket_hi - the largest number of ticks that lands in bucket b
+ */
+static unsigned long long bucket_hi(int b)
+{
+    int shift;
+
+    if (b < LAT_SUB)
+	return b;
+    shift = (b - LAT_SUB) / (LAT_SUB / 2) + 1;
+    return ((unsigned long long)((b - LAT_SUB) % (LAT_SUB / 2) +
+				 LAT_SUB / 2 + 1) << shift) - 1;
+}
+
+/*
+ * percentile - the upper end of the bucket holding the p'th fraction
+ *     of the samples, but never past the largest one
+ */
+static double percentile(lathist_t *h, double p)
+{
+    unsigned long long rank, seen = 0, hi;
+    int b;
+
+    rank = (unsigned long long)(p * h->count + 0.5);
+    if (rank < 1)
+	rank = 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	seen += h->buckets[b];
+	if (seen >= rank)
+	    break;
+    }
+    hi = bucket_hi(b);
+    if (hi > h->max)
+	hi = h->max;
+    return hi * 1e9 / tick_hz;
+}
+
+/*
+ * lathist_summary - the count, mean, tail percentiles and worst case
+ */
+void lathist_summary(lathist_t *h, latsum_t *s)
+{
+    s->count = h->count;
+    if (h->count == 0) {
+	s->mean = s->p50 = s->p99 = s->p999 = s->max = 0;
+	return;
+    }
+    s->mean = h->sum / h->count * 1e9 / tick_hz;
+    s->p50 = percentile(h, 0.5);
+    s->p99 = percentile(h, 0.99);
+    s->p999 = percentile(h, 0.999);
+    s->max = h->max * 1e9 / tick_hz;
+}
+
+static double mono_raw(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,59 @@
+/*
+ * lathist.h - log-bucketed histograms of how long single calls take
+ */
+
+/* Values below LAT_SUB ticks get a bucket each; above, every power of
+   two is split into LAT_SUB/2 buckets, so a bucket is within 1/64 */
+#define LAT_SUB_BITS 7
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS  (LAT_SUB + (64 - LAT_SUB_BITS) * (LAT_SUB / 2))
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long max;    /* ticks, overhead subtracted */
+    double sum;
+    unsigned long long buckets[LAT_BUCKETS];
+} lathist_t;
+
+/* What a histogram says, in nanoseconds */
+typedef struct {
+    double count;
+    double mean;
+    double p50, p99, p999;     /* upper end of the percentile's bucket */
+    double max;
+} latsum_t;
+
+/* Read the timestamp counter; rdtscp waits for the instructions before
+   it to finish and lfence keeps the ones after it from starting early */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline unsigned long long lat_now(void)
+{
+    unsigned int aux;
+    unsigned long long t = __rdtscp(&aux);
+
+    _mm_lfence();
+    return t;
+}
+#else
+#include <time.h>
+static inline unsigned long long lat_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* Measure the tick rate and what a pair of lat_now calls costs */
+void init_lathist(void);
+
+/* Nanoseconds lathist_add takes off every sample */
+double lathist_overhead(void);
+
+/* Count the call that ran from timestamp t0 to t1 */
+void lathist_add(lathist_t *h, unsigned long long t0, unsigned long long t1);
+
+/* Summarize h in nanoseconds */
+void lathist_summary(lathist_t *h, latsum_t *s);
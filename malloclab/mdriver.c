@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE        /* for sched_setaffinity */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,10 +16,20 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "arena.h"
+#include "trace.h"
 #include "fsecs.h"
+#include "perfctr.h"
+#include "lathist.h"
 #include "config.h"
 
 /**********************
@@ -29,6 +40,8 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define BATCH_OPS 120000 /* requests in the synthetic batch trace (-b) */
+#define ARENA_CHUNK_SIZE (64*1024) /* chunk size of the arena replay (-A) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
@@ -37,20 +50,19 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload. The ranges form a treap:
+ * a binary search tree on lo that is also a heap on a random priority,
+ * which keeps it balanced whatever order the blocks come in.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo */
+    struct range_t *right; /* ranges above lo */
+    unsigned prio;         /* no smaller than the children's */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -60,6 +72,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    size_t map_len;      /* bytes mapped for a binary trace, whose ops point
+			    into the mapping; 0 if ops was malloc'd */
 } trace_t;
 
 /* 
@@ -70,26 +84,62 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    double footprint;  /* bytes the arena held at the end of eval_arena_speed */
 } speed_t;
 
+/*
+ * Holds the params to eval_mm_threads, which replays every trace at
+ * once, each on its own thread, against a single mm heap.
+ */
+typedef struct {
+    trace_t **traces;
+    int num_traces;
+} threads_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double p95;      /* 95th percentile of the timed samples (USE_SAMPLE) */
+    double ci_lo;    /* 95% confidence interval of secs (USE_SAMPLE) */
+    double ci_hi;
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double rss;      /* heap bytes resident in memory at the end of the trace */
+    double copied;   /* payload bytes moved by reallocs that changed address */
+    double heap;     /* peak heap bytes in the timed run, or arena bytes (-A) */
+    struct mm_stats peak; /* mm_stats at the peak of live payload, with the
+			     split/coalesce/search counters of the whole trace */
+    double events[PERF_NUM]; /* event counts of one run, -1 if uncounted (-p) */
+    latsum_t lat[4];  /* latency of each request type, by trace.h type (-L) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/*
+ * What a -j worker sends back over its pipe once it has evaluated its
+ * trace. It is well under the pipe's capacity, so a worker never waits
+ * for the parent to read it.
+ */
+typedef struct {
+    stats_t mm;      /* the trace's mm stats */
+    stats_t arena;   /* its arena stats, if -A */
+    int errors;      /* malloc_error calls the worker made */
+} result_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int run_perf = 0;/* count hardware events in one more run (-p) */
+static int run_lat = 0; /* time every request in one more run (-L) */
+static int use_calloc = 0; /* serve the traces' mallocs with mm_calloc (-z) */
+static char *snap_prefix = NULL; /* write heap snapshots to files here (-H) */
+static int snap_every = 0;       /* requests between them, 0 for 256 (-I) */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -110,23 +160,53 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *insert_range(range_t *t, range_t *p);
+static range_t *join_ranges(range_t *a, range_t *b);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(trace_t *trace, char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
+static void *libc_memalign(size_t align, size_t size);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss, double *copied, struct mm_stats *peak);
 static void eval_mm_speed(void *ptr);
+static void *replay_mm_trace(void *vargp);
+static inline void replay_mm_request(trace_t *trace, int i);
+static void eval_mm_threads(void *ptr);
+static void eval_mm_latency(trace_t *trace, latsum_t lat[4]);
+static void eval_mm_snapshots(trace_t *trace, int tracenum, char *tracefile);
+static void eval_mm_trace(char *tracefile, int tracenum, int run_arena,
+			  stats_t *mm_stat, stats_t *arena_stat);
+
+/* Evaluating the traces in forked workers (-j) */
+static void eval_mm_parallel(char **tracefiles, int n, int jobs, int run_arena,
+			     stats_t *mm_stats, stats_t *arena_stats);
+static void pin_cpu(int slot);
+
+/* The synthetic batch trace (-b) */
+static trace_t *gen_batch_trace(int n);
+static int replay_mm_batch(trace_t *trace, range_t **ranges);
+static void eval_mm_batch_speed(void *ptr);
+
+/* Replaying the traces into an arena (-A) */
+static void eval_arena_speed(void *ptr);
+static void printarena(int n, stats_t *mm_stats, stats_t *arena_stats);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printtiming(int n, stats_t *stats);
+static void printevents(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats);
+static void writecsv(char *file, int n, char **tracefiles, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -145,11 +225,18 @@ int main(int argc, char **argv)
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *arena_stats = NULL; /* arena replay stats for each trace (-A) */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    threads_t thread_params;   /* input parameters to eval_mm_threads */
 
     int team_check = 0;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int run_threads = 0; /* If set, replay all traces concurrently (-T) */
+    int batch_size = 0;  /* If set, run the synthetic batch trace (-b) */
+    int run_arena = 0;   /* If set, also replay the traces into an arena (-A) */
+    char *csvfile = NULL;/* If set, write each trace's heap stats here (-c) */
+    int jobs = 1;        /* Traces evaluated at once, each in a worker (-j) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +245,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:b:c:j:H:I:hvVgalpzLTA")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +271,53 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'T': /* Replay the traces concurrently, one thread per trace */
+            if (!mm_thread_safe) {
+                fprintf(stderr, "mdriver: -T needs mm.c built with USE_THREADS=1 "
+                        "(see mdriver-mt)\n");
+                exit(1);
+            }
+            run_threads = 1;
+            break;
+        case 'c': /* Dump mm_stats for each trace as CSV */
+            csvfile = optarg;
+            break;
+        case 'p': /* Count hardware events in each trace's replay */
+            run_perf = 1;
+            break;
+        case 'H': /* Write heap snapshots of each trace to <prefix>-<n>.heap */
+            snap_prefix = optarg;
+            break;
+        case 'I': /* Requests between heap snapshots */
+            snap_every = atoi(optarg);
+            if (snap_every < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'z': /* Allocate with mm_calloc and check for zeroed payloads */
+            use_calloc = 1;
+            break;
+        case 'L': /* Histogram the latency of every request */
+            run_lat = 1;
+            break;
+        case 'A': /* Compare an arena with per-object frees */
+            run_arena = 1;
+            break;
+        case 'b': /* Compare batch and single calls on a synthetic trace */
+            batch_size = atoi(optarg);
+            if (batch_size <= 0 || batch_size > BATCH_OPS / 2) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'j': /* Evaluate up to n traces at once, one process each */
+            jobs = atoi(optarg);
+            if (jobs <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -262,6 +396,8 @@ int main(int argc, char **argv)
 		if (verbose > 1)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		fsecs_spread(&libc_stats[i].p95, &libc_stats[i].ci_lo,
+			     &libc_stats[i].ci_hi);
 	    }
 	    free_trace(trace);
 	}
@@ -281,30 +417,25 @@ int main(int argc, char **argv)
 
     /* Allocate the mm stats array, with one stats_t struct per tracefile */
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
+    arena_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+    if (mm_stats == NULL || arena_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
     
-    /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
-
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
+    /*
+     * Evaluate student's mm malloc package using the K-best scheme,
+     * either one trace after another or in forked workers (-j)
+     */
+    if (run_lat)
+	init_lathist();
+    if (jobs > 1) {
+	eval_mm_parallel(tracefiles, num_tracefiles, jobs, run_arena,
+			 mm_stats, arena_stats);
+	mem_init(); /* for -T and -b below */
+    }
+    else {
+	mem_init(); 
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracefiles[i], i, run_arena, &mm_stats[i], &arena_stats[i]);
     }
 
     /* Display the mm results in a compact table */
@@ -312,6 +443,72 @@ int main(int argc, char **argv)
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
+	if (USE_SAMPLE) {
+	    printf("Timing of mm malloc (median and 95%% CI of the samples):\n");
+	    printtiming(num_tracefiles, mm_stats);
+	    printf("\n");
+	}
+    }
+    if (csvfile != NULL)
+	writecsv(csvfile, num_tracefiles, tracefiles, mm_stats);
+    if (run_lat) {
+	printf("Latency of each mm call in one replay, in ns "
+	       "(%.0f ns of timing overhead taken off):\n", lathist_overhead());
+	printlatency(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (run_perf) {
+	printf("Events in one replay of each trace by mm malloc (per op):\n");
+	printevents(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (run_arena) {
+	printf("Results for an arena (free is a no-op, one arena_destroy per trace):\n");
+	printarena(num_tracefiles, mm_stats, arena_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally replay every trace at once, one thread per trace, to
+     * measure the aggregate throughput of a thread-safe mm package
+     */
+    if (run_threads) {
+	thread_params.num_traces = num_tracefiles;
+	if ((thread_params.traces = 
+	     (trace_t **)malloc(num_tracefiles * sizeof(trace_t *))) == NULL)
+	    unix_error("traces malloc in main failed");
+	ops = 0;
+	for (i=0; i < num_tracefiles; i++) {
+	    thread_params.traces[i] = read_trace(tracedir, tracefiles[i]);
+	    ops += thread_params.traces[i]->num_ops;
+	}
+	secs = fsecs(eval_mm_threads, &thread_params);
+	printf("Concurrent replay: %d threads, %.0f ops in %.6f secs = %.0f Kops\n",
+	       num_tracefiles, ops, secs, (ops/1e3)/secs);
+	for (i=0; i < num_tracefiles; i++)
+	    free_trace(thread_params.traces[i]);
+	free(thread_params.traces);
+    }
+
+    /*
+     * Optionally replay a synthetic trace of same-size batches twice:
+     * once with single mm_malloc/mm_free calls and once with
+     * mm_malloc_batch/mm_free_batch
+     */
+    if (batch_size > 0) {
+	trace = gen_batch_trace(batch_size);
+	speed_params.trace = trace;
+	if (eval_mm_valid(trace, 0, &ranges) &&
+	    replay_mm_batch(trace, &ranges)) {
+	    secs = fsecs(eval_mm_speed, &speed_params);
+	    p1 = fsecs(eval_mm_batch_speed, &speed_params);
+	    printf("Batch trace: %d ops in batches of %d, "
+		   "single %.0f Kops, batched %.0f Kops (%.2fx)\n",
+		   trace->num_ops, batch_size, (trace->num_ops/1e3)/secs,
+		   (trace->num_ops/1e3)/p1, secs/p1);
+	}
+	clear_ranges(&ranges);
+	free_trace(trace);
     }
 
     /* 
@@ -367,23 +564,24 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *q;
     char msg[MAXLINE];
+    static unsigned seed = 1; /* for the treap priorities */
 
     assert(size > 0);
 
@@ -395,36 +593,46 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a mapping */
+    if (!mem_contains(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /*
+     * The payload must not overlap any other payloads. Those don't
+     * overlap each other, so only the one starting last at or below hi
+     * can reach lo.
+     */
+    for (q = NULL, p = *ranges;  p != NULL; ) {
+	if (p->lo <= hi) {
+	    q = p;
+	    p = p->right;
+	}
+	else
+	    p = p->left;
+    }
+    if (q != NULL && q->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, q->lo, q->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    seed = seed * 1103515245 + 12345;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = p->right = NULL;
+    p->prio = seed >> 8;
+    *ranges = insert_range(*ranges, p);
     return 1;
 }
 
@@ -433,18 +641,14 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
+    range_t **pp = ranges;
     range_t *p;
-    range_t **prevpp = ranges;
-    int size;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    while ((p = *pp) != NULL && p->lo != lo)
+	pp = (lo < p->lo) ? &p->left : &p->right;
+    if (p != NULL) {
+	*pp = join_ranges(p->left, p->right);
+	free(p);
     }
 }
 
@@ -453,14 +657,61 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (p != NULL) {
+	clear_ranges(&p->left);
+	clear_ranges(&p->right);
+	free(p);
+	*ranges = NULL;
     }
-    *ranges = NULL;
+}
+
+/*
+ * insert_range - Insert range p into the treap rooted at t, rotating
+ *     it up past ancestors of lower priority, and return the new root
+ */
+static range_t *insert_range(range_t *t, range_t *p)
+{
+    range_t *child;
+
+    if (t == NULL)
+	return p;
+    if (p->lo < t->lo) {
+	child = t->left = insert_range(t->left, p);
+	if (child->prio > t->prio) {
+	    t->left = child->right;
+	    child->right = t;
+	    return child;
+	}
+    }
+    else {
+	child = t->right = insert_range(t->right, p);
+	if (child->prio > t->prio) {
+	    t->right = child->left;
+	    child->left = t;
+	    return child;
+	}
+    }
+    return t;
+}
+
+/*
+ * join_ranges - Merge treaps a and b, every range in a lying below
+ *     every range in b, and return the root of the result
+ */
+static range_t *join_ranges(range_t *a, range_t *b)
+{
+    if (a == NULL)
+	return b;
+    if (b == NULL)
+	return a;
+    if (a->prio > b->prio) {
+	a->right = join_ranges(a->right, b);
+	return a;
+    }
+    b->left = join_ranges(a, b->left);
+    return b;
 }
 
 
@@ -469,7 +720,8 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a text trace file, or map a binary one, and store
+ *     it in memory
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -477,7 +729,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -488,13 +740,25 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
     strcpy(path, tracedir);
     strcat(path, filename);
+
+    /* A binary trace only needs its arrays of blocks */
+    if (map_trace(trace, path)) {
+	if ((trace->blocks = 
+	     (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+	    (trace->block_sizes = 
+	     (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	    unix_error("malloc 3 failed in read_trace");
+	return trace;
+    }
+
+    /* Read the trace file header */
     if ((tracefile = fopen(path, "r")) == NULL) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+    trace->map_len = 0;
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
@@ -534,6 +798,18 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    if (align == 0 || (align & (align - 1)) != 0) {
+		printf("Bogus alignment (%u) in tracefile %s\n", align, path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -554,13 +830,73 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - If path holds a binary trace (see trace.h), map it and
+ *     fill in trace's header fields, pointing trace->ops at the records
+ *     in the mapping. Returns 1 for a binary trace, 0 for anything else.
+ *     tracegen or a hand-built file may not be what rep2bin would have
+ *     written, so every record is checked once, before it is replayed.
+ */
+static int map_trace(trace_t *trace, char *path)
+{
+    tracehdr_t hdr;
+    struct stat st;
+    traceop_t *op;
+    void *map;
+    int fd, i;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return 0;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+	close(fd);
+	return 0;
+    }
+    if (hdr.version != TRACE_VERSION || hdr.byteorder != TRACE_BYTEORDER ||
+	hdr.num_ops < 0 || hdr.num_ids < 0 || fstat(fd, &st) < 0 ||
+	st.st_size != sizeof(hdr) + (off_t)hdr.num_ops * sizeof(traceop_t)) {
+	printf("Bad header in binary tracefile %s (convert it again with rep2bin)\n",
+	       path);
+	exit(1);
+    }
+    if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+	sprintf(msg, "Could not map %s in read_trace", path);
+	unix_error(msg);
+    }
+    close(fd);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    trace->sugg_heapsize = hdr.sugg_heapsize;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->weight = hdr.weight;
+    trace->ops = (traceop_t *)((tracehdr_t *)map + 1);
+    trace->map_len = st.st_size;
+
+    /* Keep the replay inside trace->blocks */
+    for (i = 0; i < hdr.num_ops; i++) {
+	op = &trace->ops[i];
+	if ((unsigned)op->type > MEMALIGN || op->index < 0 ||
+	    op->index >= hdr.num_ids || op->size < 0 ||
+	    (op->type == MEMALIGN &&
+	     (op->align <= 0 || (op->align & (op->align - 1)) != 0))) {
+	    printf("Bad request %d in binary tracefile %s\n", i, path);
+	    exit(1);
+	}
+    }
+    return 1;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map_len > 0)   /* unmap a binary trace's ops... */
+	munmap((tracehdr_t *)trace->ops - 1, trace->map_len);
+    else
+	free(trace->ops);     /* or free them with the other two arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -602,9 +938,16 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
-
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+        case MEMALIGN: /* mm_memalign */
+
+	    /* Call the student's malloc (or calloc) or memalign */
+	    if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else if (use_calloc)
+		p = mm_calloc(1, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
@@ -616,6 +959,25 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+
+	    /* An aligned request must also honor its own alignment */
+	    if (trace->ops[i].type == MEMALIGN &&
+		((size_t)p % trace->ops[i].align) != 0) {
+		malloc_error(tracenum, i, "mm_memalign returned a misaligned block.");
+		return 0;
+	    }
+	    if (mm_usable_size(p) < (size_t)size) {
+		malloc_error(tracenum, i, "mm_usable_size is less than the request.");
+		return 0;
+	    }
+	    if (use_calloc && trace->ops[i].type == ALLOC) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			malloc_error(tracenum, i, "mm_calloc did not zero the block.");
+			return 0;
+		    }
+		}
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -653,7 +1015,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -689,14 +1051,17 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   high water mark of the heap in bytes while running the student's
+ *   malloc package on the trace. mem_sbrk() lets the package shrink
+ *   the heap, so brk alone is not the high water mark.
+ *   The heap bytes still resident in memory once the trace is done
+ *   and mm_trim has given back what it can are returned in *rss. A realloc that returns a new address must
+ *   have moved the payload, and the bytes it moved add up in *copied.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss, double *copied, struct mm_stats *peak)
 {   
+    struct mm_stats end;
     int i;
     int index;
     int size, newsize, oldsize;
@@ -705,19 +1070,27 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     char *p;
     char *newp, *oldp;
 
-    /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
+    /* initialize a heap with no pages resident, and the mm malloc package */
+    mem_reset_heap();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    *copied = 0;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else if (use_calloc)
+		p = mm_calloc(1, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -729,8 +1102,10 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    total_size += size;
 	    
 	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		mm_stats(peak);
+	    }
 	    break;
 
 	case REALLOC: /* mm_realloc */
@@ -746,13 +1121,19 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = newsize;
 	    
+	    /* A moved block had its payload copied */
+	    if (newp != oldp)
+		*copied += (oldsize < newsize) ? oldsize : newsize;
+
 	    /* Keep track of current total size
 	     * of all allocated blocks */
 	    total_size += (newsize - oldsize);
 	    
 	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		mm_stats(peak);
+	    }
 	    break;
 
         case FREE: /* mm_free */
@@ -774,7 +1155,16 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* The counters run for the whole trace */
+    mm_stats(&end);
+    peak->splits = end.splits;
+    peak->coalesces = end.coalesces;
+    peak->fit_calls = end.fit_calls;
+    peak->avg_search = end.avg_search;
+
+    mm_trim();
+    *rss = (double)mem_resident();
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -784,8 +1174,6 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
@@ -793,36 +1181,547 @@ static void eval_mm_speed(void *ptr)
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
-    /* Interpret each trace request */
+    replay_mm_trace(trace);
+}
+
+/*
+ * replay_mm_trace - Interpret each request of a trace with the mm
+ *    package, which must already be initialized. Also used as the
+ *    thread routine of eval_mm_threads.
+ */
+static void *replay_mm_trace(void *vargp)
+{
+    int i;
+    trace_t *trace = (trace_t *)vargp;
+
     for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+	replay_mm_request(trace, i);
+    return NULL;
+}
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+/*
+ * replay_mm_request - Make the i'th request of a trace to the mm package
+ */
+static inline void replay_mm_request(trace_t *trace, int i)
+{
+    int index, size, newsize;
+    char *p, *newp, *oldp, *block;
 
-	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
-            break;
+    switch (trace->ops[i].type) {
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            block = trace->blocks[index];
-            mm_free(block);
-            break;
+    case ALLOC: /* mm_malloc */
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	p = use_calloc ? mm_calloc(1, size) : mm_malloc(size);
+	if (p == NULL)
+	    app_error("mm_malloc error in eval_mm_speed");
+	trace->blocks[index] = p;
+	break;
+
+    case MEMALIGN: /* mm_memalign */
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+	    app_error("mm_memalign error in eval_mm_speed");
+	trace->blocks[index] = p;
+	break;
+
+    case REALLOC: /* mm_realloc */
+	index = trace->ops[i].index;
+	newsize = trace->ops[i].size;
+	oldp = trace->blocks[index];
+	if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    app_error("mm_realloc error in eval_mm_speed");
+	trace->blocks[index] = newp;
+	break;
+
+    case FREE: /* mm_free */
+	index = trace->ops[i].index;
+	block = trace->blocks[index];
+	mm_free(block);
+	break;
+
+    default:
+	app_error("Nonexistent request type in eval_mm_valid");
+    }
+}
+
+/*
+ * eval_mm_threads - This is the function that is used by fcyc() to
+ *    measure the aggregate running time of the mm malloc package when
+ *    every trace is replayed at the same time on its own thread. The
+ *    mm package must be built with USE_THREADS=1.
+ */
+static void eval_mm_threads(void *ptr)
+{
+    int i;
+    threads_t *params = (threads_t *)ptr;
+    pthread_t *tids;
+
+    if ((tids = (pthread_t *)malloc(params->num_traces * sizeof(pthread_t))) == NULL)
+	unix_error("malloc failed in eval_mm_threads");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_threads");
+
+    for (i = 0; i < params->num_traces; i++)
+	if (pthread_create(&tids[i], NULL, replay_mm_trace, params->traces[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_threads");
+    for (i = 0; i < params->num_traces; i++)
+	pthread_join(tids[i], NULL);
+    free(tids);
+}
 
+/*
+ * eval_mm_latency - Replay a trace like eval_mm_speed, timestamping
+ *    each request, and summarize the latencies of each type of request
+ *    in lat, indexed by its trace.h type
+ */
+static void eval_mm_latency(trace_t *trace, latsum_t lat[4])
+{
+    static lathist_t hists[4]; /* too big for the stack */
+    int i, index, type;
+    char *p;
+    unsigned long long t0, t1;
+
+    memset(hists, 0, sizeof(hists));
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	type = trace->ops[i].type;
+	index = trace->ops[i].index;
+	t0 = lat_now();
+	switch (type) {
+	case ALLOC:
+	    if (use_calloc)
+		p = mm_calloc(1, trace->ops[i].size);
+	    else
+		p = mm_malloc(trace->ops[i].size);
+	    break;
+	case MEMALIGN:
+	    p = mm_memalign(trace->ops[i].align, trace->ops[i].size);
+	    break;
+	case REALLOC:
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    break;
+	case FREE:
+	    mm_free(trace->blocks[index]);
+	    p = NULL;
+	    break;
 	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
-        }
+	    app_error("Nonexistent request type in eval_mm_latency");
+	}
+	t1 = lat_now();
+	if (type != FREE) {
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	}
+	lathist_add(&hists[type], t0, t1);
+    }
+    for (type = 0; type < 4; type++)
+	lathist_summary(&hists[type], &lat[type]);
+}
+
+/*
+ * eval_mm_snapshots - Replay a trace, writing an mm_snapshot of the
+ *    heap to <snap_prefix>-<tracenum>.heap every snap_every requests
+ *    (or often enough for 256 of them) and after the last one
+ */
+static void eval_mm_snapshots(trace_t *trace, int tracenum, char *tracefile)
+{
+    char path[MAXLINE];
+    FILE *fp;
+    int i, every;
+
+    every = snap_every ? snap_every : (trace->num_ops + 255) / 256;
+    snprintf(path, MAXLINE, "%s-%d.heap", snap_prefix, tracenum);
+    if ((fp = fopen(path, "w")) == NULL) {
+	snprintf(msg, MAXLINE, "Could not open %.900s in eval_mm_snapshots", path);
+	unix_error(msg);
+    }
+    fprintf(fp, "# %s: %d requests, a snapshot every %d\n",
+	    tracefile, trace->num_ops, every);
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_snapshots");
+    for (i = 0;  i < trace->num_ops;  i++) {
+	replay_mm_request(trace, i);
+	if ((i + 1) % every == 0 || i + 1 == trace->num_ops)
+	    mm_snapshot(fp, i + 1);
+    }
+    fclose(fp);
+}
+
+/*
+ * eval_mm_trace - Check one trace file for correctness, then measure
+ *    its utilization and throughput, and with run_arena those of an
+ *    arena replaying it as well. Stats that depend on a valid trace
+ *    are left alone if it is not.
+ */
+static void eval_mm_trace(char *tracefile, int tracenum, int run_arena,
+			  stats_t *mm_stat, stats_t *arena_stat)
+{
+    trace_t *trace;
+    range_t *ranges = NULL;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, tracefile);
+    mm_stat->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    mm_stat->valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (mm_stat->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	mm_stat->util = eval_mm_util(trace, tracenum, &ranges, &mm_stat->rss,
+				     &mm_stat->copied, &mm_stat->peak);
+	speed_params.trace = trace;
+	speed_params.ranges = ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	mm_stat->secs = fsecs(eval_mm_speed, &speed_params);
+	fsecs_spread(&mm_stat->p95, &mm_stat->ci_lo, &mm_stat->ci_hi);
+	mm_stat->heap = mem_peak_heapsize();
+
+	/* One more, warm run with the event counters on. They are
+	   opened here so that -j workers count themselves. */
+	if (run_perf) {
+	    init_perfctr();
+	    perfctr_start();
+	    eval_mm_speed(&speed_params);
+	    perfctr_stop(mm_stat->events);
+	}
+	if (run_lat)
+	    eval_mm_latency(trace, mm_stat->lat);
+	if (snap_prefix != NULL)
+	    eval_mm_snapshots(trace, tracenum, tracefile);
+
+	/* The same requests with frees dropped, out of one arena */
+	if (run_arena) {
+	    arena_stat->ops = trace->num_ops;
+	    eval_arena_speed(&speed_params); /* skip timing if it can't fit */
+	    arena_stat->valid = speed_params.footprint > 0;
+	    if (arena_stat->valid) {
+		arena_stat->secs = fsecs(eval_arena_speed, &speed_params);
+		arena_stat->heap = speed_params.footprint;
+	    }
+	}
+    }
+    clear_ranges(&ranges);
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_parallel - Evaluate the n traces with eval_mm_trace, up to
+ *    jobs of them at once, but never more than there are CPUs to run
+ *    on. Each trace gets a forked worker with its own memlib heap and mm
+ *    state, pinned to the CPU of its job slot so concurrent workers
+ *    don't time each other. A worker sends
+ *    its result_t back over a pipe; one that dies before it does counts
+ *    as an error and leaves its trace invalid.
+ */
+static void eval_mm_parallel(char **tracefiles, int n, int jobs, int run_arena,
+			     stats_t *mm_stats, stats_t *arena_stats)
+{
+    pid_t *pids;        /* worker running in each job slot, or 0 */
+    int *fds;           /* read end of that worker's pipe */
+    int *nums;          /* trace that worker is evaluating */
+    int pipefd[2];
+    int next, running, slot, status;
+    result_t result;
+    pid_t pid;
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+	jobs > CPU_COUNT(&allowed))
+	jobs = CPU_COUNT(&allowed);
+    if (jobs > n)
+	jobs = n;
+    pids = (pid_t *)calloc(jobs, sizeof(pid_t));
+    fds = (int *)calloc(jobs, sizeof(int));
+    nums = (int *)calloc(jobs, sizeof(int));
+    if (pids == NULL || fds == NULL || nums == NULL)
+	unix_error("eval_mm_parallel calloc failed");
+
+    next = running = 0;
+    while (next < n || running > 0) {
+	/* Start a worker in every free slot */
+	for (slot = 0; slot < jobs && next < n; slot++) {
+	    if (pids[slot] != 0)
+		continue;
+	    if (pipe(pipefd) < 0)
+		unix_error("pipe failed in eval_mm_parallel");
+	    fflush(stdout); /* or the worker prints it again */
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_parallel");
+	    if (pid == 0) {
+		close(pipefd[0]);
+		pin_cpu(slot);
+		mem_init();
+		memset(&result, 0, sizeof(result));
+		eval_mm_trace(tracefiles[next], next, run_arena,
+			      &result.mm, &result.arena);
+		result.errors = errors;
+		if (write(pipefd[1], &result, sizeof(result)) != sizeof(result))
+		    unix_error("write failed in eval_mm_parallel");
+		fflush(stdout);
+		_exit(0);
+	    }
+	    close(pipefd[1]);
+	    pids[slot] = pid;
+	    fds[slot] = pipefd[0];
+	    nums[slot] = next++;
+	    running++;
+	}
+
+	/* Collect the next worker to finish */
+	if ((pid = waitpid(-1, &status, 0)) < 0)
+	    unix_error("waitpid failed in eval_mm_parallel");
+	for (slot = 0; slot < jobs && pids[slot] != pid; slot++)
+	    ;
+	if (slot == jobs)
+	    continue;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+	    read(fds[slot], &result, sizeof(result)) == sizeof(result)) {
+	    mm_stats[nums[slot]] = result.mm;
+	    arena_stats[nums[slot]] = result.arena;
+	    errors += result.errors;
+	}
+	else {
+	    mm_stats[nums[slot]].valid = 0;
+	    errors++;
+	    printf("ERROR [trace %d]: worker %d died before reporting\n",
+		   nums[slot], (int)pid);
+	}
+	close(fds[slot]);
+	pids[slot] = 0;
+	running--;
+    }
+
+    free(pids);
+    free(fds);
+    free(nums);
+}
+
+/*
+ * pin_cpu - Bind the calling process to the slot'th CPU it may run on,
+ *    wrapping around when there are more slots than CPUs
+ */
+static void pin_cpu(int slot)
+{
+    cpu_set_t allowed, mine;
+    int cpu, count;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+	return;
+    slot %= CPU_COUNT(&allowed);
+    for (cpu = 0, count = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (CPU_ISSET(cpu, &allowed) && count++ == slot)
+	    break;
+    }
+    CPU_ZERO(&mine);
+    CPU_SET(cpu, &mine);
+    sched_setaffinity(0, sizeof(mine), &mine);
+}
+
+/*
+ * gen_batch_trace - Build a trace that allocates batches of n blocks of
+ *    one size and later frees each batch as a whole, in shuffled order,
+ *    while the next batch is live. Batch ids are consecutive, so a batch
+ *    is a run of ALLOC ops with the same size and increasing ids.
+ */
+static trace_t *gen_batch_trace(int n)
+{
+    trace_t *trace;
+    int rounds = BATCH_OPS / (2 * n);
+    int r, i, j, op = 0, tmp;
+    int *order;
+    unsigned seed = 1;
+
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL ||
+	(order = (int *) malloc(n * sizeof(int))) == NULL)
+	unix_error("malloc 1 failed in gen_batch_trace");
+    trace->sugg_heapsize = 0;
+    trace->num_ids = rounds * n;
+    trace->num_ops = 2 * rounds * n;
+    trace->weight = 1;
+    trace->map_len = 0;
+    if ((trace->ops = 
+	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL ||
+	(trace->blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+	(trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 2 failed in gen_batch_trace");
+
+    for (r = 0; r <= rounds; r++) {
+	/* allocate batch r: one size between 16 and 256 bytes */
+	seed = seed * 1103515245 + 12345;
+	for (i = 0; r < rounds && i < n; i++) {
+	    trace->ops[op].type = ALLOC;
+	    trace->ops[op].index = r * n + i;
+	    trace->ops[op].size = 16 + 8 * ((seed >> 16) % 31);
+	    op++;
+	}
+
+	/* then free batch r-1 in a random order */
+	if (r == 0)
+	    continue;
+	for (i = 0; i < n; i++)
+	    order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+	    seed = seed * 1103515245 + 12345;
+	    j = (seed >> 16) % (i + 1);
+	    tmp = order[i];
+	    order[i] = order[j];
+	    order[j] = tmp;
+	}
+	for (i = 0; i < n; i++) {
+	    trace->ops[op].type = FREE;
+	    trace->ops[op].index = (r - 1) * n + order[i];
+	    op++;
+	}
+    }
+    free(order);
+    return trace;
+}
+
+/*
+ * replay_mm_batch - Interpret a trace with mm_malloc_batch for every
+ *    run of same-size ALLOC ops with consecutive ids and mm_free_batch
+ *    for every run of FREE ops. The mm package must already be
+ *    initialized. If ranges is not NULL, every block is checked as in
+ *    eval_mm_valid, after resetting the heap.
+ */
+static int replay_mm_batch(trace_t *trace, range_t **ranges)
+{
+    int i, j, k, size;
+    void **ptrs;
+
+    if ((ptrs = (void **)malloc(trace->num_ops * sizeof(void *))) == NULL)
+	unix_error("malloc failed in replay_mm_batch");
+    if (ranges != NULL) {
+	mem_reset_brk();
+	clear_ranges(ranges);
+	if (mm_init() < 0)
+	    app_error("mm_init failed in replay_mm_batch");
+    }
+
+    for (i = 0; i < trace->num_ops; i = j) {
+	size = trace->ops[i].size;
+	j = i + 1;
+	if (trace->ops[i].type == ALLOC) {
+	    while (j < trace->num_ops && trace->ops[j].type == ALLOC &&
+		   trace->ops[j].size == size &&
+		   trace->ops[j].index == trace->ops[i].index + (j - i))
+		j++;
+	    if (mm_malloc_batch(size, j - i, 
+				(void **)&trace->blocks[trace->ops[i].index]) != j - i) {
+		malloc_error(0, i, "mm_malloc_batch failed.");
+		free(ptrs);
+		return 0;
+	    }
+	    for (k = i; ranges != NULL && k < j; k++) {
+		if (add_range(ranges, trace->blocks[trace->ops[k].index],
+			      size, 0, k) == 0) {
+		    free(ptrs);
+		    return 0;
+		}
+	    }
+	}
+	else if (trace->ops[i].type == FREE) {
+	    while (j < trace->num_ops && trace->ops[j].type == FREE)
+		j++;
+	    for (k = i; k < j; k++) {
+		ptrs[k - i] = trace->blocks[trace->ops[k].index];
+		if (ranges != NULL)
+		    remove_range(ranges, ptrs[k - i]);
+	    }
+	    mm_free_batch(ptrs, j - i);
+	}
+	else
+	    app_error("replay_mm_batch handles only alloc and free requests");
+    }
+    free(ptrs);
+    return 1;
+}
+
+/*
+ * eval_mm_batch_speed - The fcyc() routine that times replay_mm_batch
+ */
+static void eval_mm_batch_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_batch_speed");
+    replay_mm_batch(trace, NULL);
+}
+
+/*
+ * eval_arena_speed - The fcyc() routine that replays a trace into one
+ *    arena whose chunks come from mm_malloc. Frees are dropped, reallocs
+ *    go through arena_realloc, and the arena is destroyed at the end.
+ *    The bytes the arena held are left in the footprint field, which is
+ *    0 if it ran out of memory.
+ */
+static void eval_arena_speed(void *ptr)
+{
+    speed_t *params = (speed_t *)ptr;
+    trace_t *trace = params->trace;
+    arena_t *a;
+    int i, index, size, align;
+    char *p;
+
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_arena_speed");
+    params->footprint = 0;
+    if ((a = arena_create(ARENA_CHUNK_SIZE, ARENA_FROM_MM)) == NULL)
+	return;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* arena_alloc */
+	    p = arena_alloc(a, size);
+	    break;
+
+	case MEMALIGN: /* arena_alloc, with room to round up */
+	    align = trace->ops[i].align;
+	    if ((p = arena_alloc(a, size + align - 1)) != NULL)
+		p = (char *)(((size_t)p + align - 1) & ~(size_t)(align - 1));
+	    break;
+
+	case REALLOC: /* arena_realloc */
+	    p = arena_realloc(a, trace->blocks[index], 
+			      trace->block_sizes[index], size);
+	    break;
+
+	case FREE: /* nothing until the arena goes */
+	    continue;
+
+	default:
+	    app_error("Nonexistent request type in eval_arena_speed");
+	    return;
+	}
+	if (p == NULL) {
+	    arena_destroy(a);
+	    return;
+	}
+	trace->blocks[index] = p;
+	trace->block_sizes[index] = size;
+    }
+    params->footprint = arena_footprint(a);
+    arena_destroy(a);
 }
 
 /*
@@ -847,6 +1746,14 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    if ((p = libc_memalign(trace->ops[i].align, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -869,6 +1776,21 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
     return 1;
 }
 
+/*
+ * libc_memalign - posix_memalign with a memalign-style interface; it
+ *    needs an alignment of at least sizeof(void *)
+ */
+static void *libc_memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (align < sizeof(void *))
+	align = sizeof(void *);
+    if ((errno = posix_memalign(&p, align, size)) != 0)
+	return NULL;
+    return p;
+}
+
 /* 
  * eval_libc_speed - This is the function that is used by fcyc() to
  *    measure the running time of the libc malloc package on the set
@@ -891,6 +1813,14 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = libc_memalign(trace->ops[i].align, size)) == NULL)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -915,6 +1845,181 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * writecsv - writes one CSV row of heap telemetry per valid trace: the
+ *    mm_stats snapshot at the trace's peak of live payload bytes and the
+ *    counters of the whole trace
+ */
+static void writecsv(char *file, int n, char **tracefiles, stats_t *stats)
+{
+    FILE *fp;
+    int i, j, classes = 0;
+
+    if ((fp = fopen(file, "w")) == NULL) {
+	sprintf(msg, "Could not open %s in writecsv", file);
+	unix_error(msg);
+    }
+    /* an invalid trace, or one whose -j worker died, has no snapshot */
+    for (i = 0; i < n; i++) {
+	if (stats[i].valid) {
+	    classes = stats[i].peak.classes;
+	    break;
+	}
+    }
+    fprintf(fp, "trace,util,heap_bytes,used_bytes,free_bytes,largest_free,"
+	    "fragmentation,splits,coalesces,fit_calls,avg_search");
+    for (j = 0; j < classes; j++)
+	fprintf(fp, ",class%d", j);
+    fprintf(fp, "\n");
+
+    for (i = 0; i < n; i++) {
+	struct mm_stats *st = &stats[i].peak;
+	if (!stats[i].valid)
+	    continue;
+	fprintf(fp, "%s,%.4f,%zu,%zu,%zu,%zu,%.4f,%lu,%lu,%lu,%.3f",
+		tracefiles[i], stats[i].util, st->heap_bytes, st->used_bytes,
+		st->free_bytes, st->largest_free, st->fragmentation,
+		st->splits, st->coalesces, st->fit_calls, st->avg_search);
+	for (j = 0; j < classes; j++)
+	    fprintf(fp, ",%zu", st->class_free[j]);
+	fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+/*
+ * printtiming - Print how far each trace's time can be trusted: the
+ *     median sample with its 95% confidence interval, in microseconds
+ *     and as a share of the median, and the 95th percentile
+ */
+static void printtiming(int n, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%12s%24s%8s%12s\n",
+	   "trace", "median(us)", "95% CI(us)", "+/-", "p95(us)");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid && stats[i].secs > 0)
+	    printf("%2d%15.1f%11.1f ..%10.1f%7.1f%%%12.1f\n",
+		   i,
+		   stats[i].secs*1e6,
+		   stats[i].ci_lo*1e6,
+		   stats[i].ci_hi*1e6,
+		   (stats[i].ci_hi - stats[i].ci_lo)/2/stats[i].secs*100.0,
+		   stats[i].p95*1e6);
+	else
+	    printf("%2d%15s%24s%8s%12s\n", i, "-", "-", "-", "-");
+    }
+}
+
+/*
+ * printlatency - Print the latency percentiles of each type of request
+ *     in each trace, skipping the types a trace doesn't make
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    static char *names[4] = {"malloc", "free", "realloc", "memalign"};
+    int i, type;
+    latsum_t *l;
+
+    printf("%5s %-9s%8s%8s%8s%8s%8s%10s\n",
+	   "trace", "call", "count", "mean", "p50", "p99", "p99.9", "max");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid) {
+	    printf("%2d%6s\n", i, "-");
+	    continue;
+	}
+	for (type = 0; type < 4; type++) {
+	    l = &stats[i].lat[type];
+	    if (l->count == 0)
+		continue;
+	    printf("%2d    %-9s%8.0f%8.0f%8.0f%8.0f%8.0f%10.0f\n",
+		   i, names[type], l->count, l->mean,
+		   l->p50, l->p99, l->p999, l->max);
+	}
+    }
+}
+
+/*
+ * printevents - Print what the event counters saw in each trace's
+ *     counted run, per op and as instructions per cycle. Events the
+ *     counters could not count print as "-", and if that is every
+ *     hardware event, say so.
+ */
+static void printevents(int n, stats_t *stats)
+{
+    int i, j, hw = 0;
+    double *ev;
+
+    printf("%5s%10s%7s%10s%10s%10s%10s%9s\n",
+	   "trace", "cyc/op", "IPC", "L1d-miss", "LLC-miss", "br-miss",
+	   "dTLB-miss", "faults");
+    for (i=0; i < n; i++) {
+	ev = stats[i].events;
+	if (!stats[i].valid || stats[i].ops == 0) {
+	    printf("%2d%13s%7s%10s%10s%10s%10s%9s\n",
+		   i, "-", "-", "-", "-", "-", "-", "-");
+	    continue;
+	}
+	printf("%2d", i);
+	if (ev[PERF_CYCLES] >= 0)
+	    printf("%13.1f", ev[PERF_CYCLES]/stats[i].ops);
+	else
+	    printf("%13s", "-");
+	if (ev[PERF_CYCLES] > 0 && ev[PERF_INSTRUCTIONS] >= 0)
+	    printf("%7.2f", ev[PERF_INSTRUCTIONS]/ev[PERF_CYCLES]);
+	else
+	    printf("%7s", "-");
+	for (j = PERF_L1D_MISSES; j <= PERF_DTLB_MISSES; j++) {
+	    if (ev[j] >= 0)
+		printf("%10.3f", ev[j]/stats[i].ops);
+	    else
+		printf("%10s", "-");
+	}
+	if (ev[PERF_FAULTS] >= 0)
+	    printf("%9.0f\n", ev[PERF_FAULTS]);
+	else
+	    printf("%9s\n", "-");
+	for (j = 0; j < PERF_FAULTS; j++)
+	    if (ev[j] >= 0)
+		hw = 1;
+    }
+    if (!hw)
+	printf("Hardware counters unavailable "
+	       "(no PMU, or perf_event_paranoid forbids them).\n");
+}
+
+/*
+ * printarena - prints the arena replay of each trace next to mm's run
+ */
+static void printarena(int n, stats_t *mm_stats, stats_t *arena_stats)
+{
+    int i;
+    double mm_secs = 0, arena_secs = 0, ops = 0;
+
+    printf("%5s%10s%12s%10s%12s\n", 
+	   "trace", "mm Kops", "arena Kops", "heap(KB)", "arena(KB)");
+    for (i=0; i < n; i++) {
+	if (mm_stats[i].valid && arena_stats[i].valid) {
+	    printf("%2d%13.0f%12.0f%10.0f%12.0f\n", 
+		   i,
+		   (mm_stats[i].ops/1e3)/mm_stats[i].secs,
+		   (arena_stats[i].ops/1e3)/arena_stats[i].secs,
+		   mm_stats[i].heap/1024,
+		   arena_stats[i].heap/1024);
+	    mm_secs += mm_stats[i].secs;
+	    arena_secs += arena_stats[i].secs;
+	    ops += mm_stats[i].ops;
+	}
+	else {
+	    printf("%2d%13s%12s%10s%12s\n", i, "-", "-", "-", "-");
+	}
+    }
+    if (ops > 0)
+	printf("%-5s%10.0f%12.0f\n", "Total", 
+	       (ops/1e3)/mm_secs, (ops/1e3)/arena_secs);
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -926,28 +2031,33 @@ static void printresults(int n, stats_t *stats)
     double util = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%8s%9s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "rss(KB)",
+	   "copy(KB)");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f%8.0f%9.0f\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].rss/1024,
+		   stats[i].copied/1024);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s%8s%9s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
@@ -1004,14 +2114,31 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValpzLTA] [-f <file>] [-t <dir>] [-b <n>] [-c <csv>] [-j <n>]\n"
+		    "              [-H <prefix>] [-I <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-A         Also replay each trace into an arena, without frees.\n");
+    fprintf(stderr, "\t-b <n>     Also time a synthetic trace of n-block batches,\n");
+    fprintf(stderr, "\t           with single calls and with mm_malloc_batch.\n");
+    fprintf(stderr, "\t-c <csv>   Write each trace's mm_stats heap telemetry to <csv>.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <pfx>   Write heap snapshots of trace n to <pfx>-n.heap.\n");
+    fprintf(stderr, "\t-I <n>     Take them every n requests (default: 256 per trace).\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to n traces at once, each in its own\n");
+    fprintf(stderr, "\t           process pinned to its own CPU.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Time every request in one more replay of each\n");
+    fprintf(stderr, "\t           trace and print latency percentiles per call.\n");
+    fprintf(stderr, "\t-p         Count cycles, cache/TLB/branch misses and faults\n");
+    fprintf(stderr, "\t           in one more replay of each trace.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T         Also replay all traces at once, one thread each\n");
+    fprintf(stderr, "\t           (needs mm.c built with USE_THREADS=1).\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-z         Serve the traces' mallocs with mm_calloc and check\n");
+    fprintf(stderr, "\t           that they come back zeroed.\n");
 }
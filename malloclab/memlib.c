@@ -2,7 +2,14 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The heap can also be split into equal regions, each with its
+ *            own break, so that independent arenas can grow side by side.
+ *
+ *            Memory can also be mapped outside the heap (mem_map) for
+ *            blocks too large to carve from it.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,60 +17,377 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */
+static char *region_brk[MAX_REGIONS]; /* points to last byte of each region */
+static char *region_clean[MAX_REGIONS]; /* region reads as zero from here up */
+static size_t region_span;   /* bytes reserved for each region */
+static int num_regions;      /* number of regions the heap is split into */
+static size_t mem_size;      /* bytes in use across all regions */
+static size_t mem_peak;      /* largest mem_size since the last reset */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* guards region_brk, mappings */
+
+/* a mapping made outside the heap by mem_map */
+typedef struct mapping {
+    char *lo;              /* first byte of the mapping */
+    size_t len;            /* length in bytes, a multiple of the page size */
+    struct mapping *next;
+} mapping_t;
+
+static mapping_t *mappings;  /* live mappings, most recent first */
+
+static mapping_t **find_mapping(void *lo);
+static char *page_up(char *p);
+static void reset_heap(int release);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *) malloc(MAX_HEAP)) == NULL) {
+#if USE_MMAP_HEAP
+    /* reserve address space only; pages are faulted in as the heap grows */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
+        exit(1);
+    }
+#else
+    if ((mem_start_brk = (char *) calloc(1, MAX_HEAP)) == NULL) {
         fprintf(stderr, "mem_init_vm: malloc error\n");
         exit(1);
     }
+#endif
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    num_regions = 1;                          /* one region spanning the heap */
+    region_span = MAX_HEAP;
+    region_brk[0] = mem_start_brk;            /* heap is empty initially */
+    region_clean[0] = mem_start_brk;          /* ... and all zero */
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
+#if USE_MMAP_HEAP
+    munmap(mem_start_brk, MAX_HEAP);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make an empty heap.
+ *    The pages stay mapped, so a replay that follows runs on a warm heap.
  */
 void mem_reset_brk() {
-    mem_brk = mem_start_brk;
+    reset_heap(0);
+}
+
+/*
+ * mem_reset_heap - make an empty heap like mem_reset_brk, but also hand
+ *    back every page the heap used, so that mem_resident counts only what
+ *    the next replay touches. Each page then faults in again when used.
+ */
+void mem_reset_heap() {
+    reset_heap(1);
+}
+
+/*
+ * reset_heap - empty every region, releasing its used pages if release
+ */
+static void reset_heap(int release) {
+    int i;
+
+    pthread_mutex_lock(&mem_lock);
+    for (i = 0; i < num_regions; i++) {
+        if (release) {
+            mem_release(mem_start_brk + i * region_span,
+                        page_up(region_clean[i]) - (mem_start_brk + i * region_span));
+#if USE_MMAP_HEAP
+            region_clean[i] = mem_start_brk + i * region_span;  /* every used page was released */
+#endif
+        }
+        region_brk[i] = mem_start_brk + i * region_span;
+    }
+    while (mappings != NULL) {
+        mapping_t *m = mappings;
+        mappings = m->next;
+        munmap(m->lo, m->len);
+        free(m);
+    }
+    mem_size = 0;
+    mem_peak = 0;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_set_regions - split the heap into n equal regions, each starting
+ *    out empty. Region 0 is the one grown by mem_sbrk.
+ */
+void mem_set_regions(int n) {
+    int i;
+    char *dirty = mem_start_brk;  /* everything above this reads as zero */
+
+    assert(n >= 1 && n <= MAX_REGIONS);
+    mem_reset_brk();
+    pthread_mutex_lock(&mem_lock);
+    for (i = 0; i < num_regions; i++)
+        if (region_clean[i] != mem_start_brk + i * region_span && region_clean[i] > dirty)
+            dirty = region_clean[i];
+    num_regions = n;
+    region_span = (MAX_HEAP / n) & ~(mem_pagesize() - 1);
+    for (i = 0; i < num_regions; i++) {
+        region_brk[i] = mem_start_brk + i * region_span;
+        region_clean[i] = (dirty < region_brk[i]) ? region_brk[i] :
+            (dirty > region_brk[i] + region_span) ? region_brk[i] + region_span : dirty;
+    }
+    pthread_mutex_unlock(&mem_lock);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A 
+ *    negative incr shrinks the heap and releases the pages above the
+ *    new break. Safe to call from several threads.
  */
 void *mem_sbrk(int incr) {
-    char *old_brk = mem_brk;
+    return mem_region_sbrk(0, incr);
+}
 
-    if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+/*
+ * mem_region_sbrk - mem_sbrk for one region of a split heap
+ */
+void *mem_region_sbrk(int region, int incr) {
+    char *old_brk;
+    char *max_addr;
+
+    pthread_mutex_lock(&mem_lock);
+    old_brk = region_brk[region];
+    max_addr = (region == num_regions - 1) ? mem_max_addr :
+        mem_start_brk + (region + 1) * region_span;
+    if (old_brk + incr < mem_start_brk + region * region_span) {
+        pthread_mutex_unlock(&mem_lock);
+        errno = EINVAL;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap start...\n");
+        return (void *) -1;
+    }
+    if ((old_brk + incr) > max_addr) {
+        pthread_mutex_unlock(&mem_lock);
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *) -1;
     }
-    mem_brk += incr;
+    region_brk[region] += incr;
+    mem_size += incr;
+    if (mem_size > mem_peak)
+        mem_peak = mem_size;
+    if (region_brk[region] > region_clean[region])
+        region_clean[region] = region_brk[region];
+    if (incr < 0) {
+        mem_release(region_brk[region], page_up(region_clean[region]) - region_brk[region]);
+#if USE_MMAP_HEAP
+        if (page_up(region_brk[region]) < region_clean[region])
+            region_clean[region] = page_up(region_brk[region]);
+#endif
+    }
+    pthread_mutex_unlock(&mem_lock);
     return (void *) old_brk;
 }
 
+/*
+ * mem_map - map len bytes of fresh, zeroed memory outside the heap
+ *    and return its page-aligned start, or NULL on failure. The
+ *    mapping counts toward the heap size until mem_unmap.
+ */
+void *mem_map(size_t len) {
+    mapping_t *m;
+    char *lo;
+
+    len = (len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if ((m = (mapping_t *) malloc(sizeof(mapping_t))) == NULL)
+        return NULL;
+    lo = mmap(NULL, len, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo == MAP_FAILED) {
+        free(m);
+        return NULL;
+    }
+    m->lo = lo;
+    m->len = len;
+
+    pthread_mutex_lock(&mem_lock);
+    m->next = mappings;
+    mappings = m;
+    mem_size += len;
+    if (mem_size > mem_peak)
+        mem_peak = mem_size;
+    pthread_mutex_unlock(&mem_lock);
+    return lo;
+}
+
+/*
+ * mem_unmap - release a mapping returned by mem_map or mem_remap
+ */
+void mem_unmap(void *lo) {
+    mapping_t **link, *m;
+
+    pthread_mutex_lock(&mem_lock);
+    link = find_mapping(lo);
+    assert(link != NULL);
+    m = *link;
+    *link = m->next;
+    mem_size -= m->len;
+    pthread_mutex_unlock(&mem_lock);
+
+    munmap(m->lo, m->len);
+    free(m);
+}
+
+/*
+ * mem_remap - resize a mapping to len bytes with mremap, moving it
+ *    if it cannot grow in place; the contents are kept without a copy.
+ *    Returns the new start, or NULL (leaving the mapping intact).
+ */
+void *mem_remap(void *lo, size_t len) {
+    mapping_t **link, *m;
+    char *new_lo;
+
+    len = (len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    pthread_mutex_lock(&mem_lock);
+    link = find_mapping(lo);
+    assert(link != NULL);
+    m = *link;
+    new_lo = mremap(m->lo, m->len, len, MREMAP_MAYMOVE);
+    if (new_lo == MAP_FAILED) {
+        pthread_mutex_unlock(&mem_lock);
+        return NULL;
+    }
+    mem_size += len - m->len;
+    if (mem_size > mem_peak)
+        mem_peak = mem_size;
+    m->lo = new_lo;
+    m->len = len;
+    pthread_mutex_unlock(&mem_lock);
+    return new_lo;
+}
+
+/*
+ * find_mapping - return the link that points to the mapping starting
+ *    at lo, or NULL if there is none. Call with mem_lock held.
+ */
+static mapping_t **find_mapping(void *lo) {
+    mapping_t **link;
+
+    for (link = &mappings; *link != NULL; link = &(*link)->next)
+        if ((*link)->lo == lo)
+            return link;
+    return NULL;
+}
+
+/*
+ * mem_contains - return 1 if [lo, hi] lies inside the heap or inside
+ *    a single mapping made by mem_map, else 0
+ */
+int mem_contains(void *lo, void *hi) {
+    mapping_t *m;
+    int found = 0;
+
+    if ((char *) lo >= (char *) mem_heap_lo() && (char *) hi <= (char *) mem_heap_hi())
+        return 1;
+    pthread_mutex_lock(&mem_lock);
+    for (m = mappings; m != NULL && !found; m = m->next)
+        found = (char *) lo >= m->lo && (char *) hi < m->lo + m->len;
+    pthread_mutex_unlock(&mem_lock);
+    return found;
+}
+
+/*
+ * mem_release - tell the OS that the whole pages in [lo, lo+len) hold
+ *    no data. They read back as zero and stop counting toward the
+ *    resident set. Only the mmap backend can do this; otherwise the
+ *    call has no effect.
+ */
+void mem_release(void *lo, size_t len) {
+#if USE_MMAP_HEAP
+    size_t mask = mem_pagesize() - 1;
+    char *start = (char *) (((size_t) lo + mask) & ~mask);
+    char *end = (char *) (((size_t) lo + len) & ~mask);
+
+    if (start < end)
+        madvise(start, end - start, MADV_DONTNEED);
+#endif
+}
+
+/*
+ * mem_resident - return the number of heap bytes currently resident
+ *    in physical memory, as reported by mincore
+ */
+size_t mem_resident(void) {
+    size_t mask = mem_pagesize() - 1;
+    char *start = (char *) ((size_t) mem_start_brk & ~mask);
+    size_t pages = (mem_max_addr - start + mask) / (mask + 1);
+    unsigned char *vec;
+    size_t i, resident = 0;
+    mapping_t *m;
+
+    if ((vec = (unsigned char *) malloc(pages)) == NULL)
+        return 0;
+    if (mincore(start, pages * (mask + 1), vec) == 0)
+        for (i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+    free(vec);
+    resident *= mask + 1;
+
+    /* pages of a mapping are all touched by the time they are counted */
+    pthread_mutex_lock(&mem_lock);
+    for (m = mappings; m != NULL; m = m->next)
+        resident += m->len;
+    pthread_mutex_unlock(&mem_lock);
+    return resident;
+}
+
+/*
+ * mem_region_clean - return the address from which a region is known
+ *    to read as zero up to its end. Memory is zero until it has been
+ *    inside the break; with the mmap backend, pages given back by a
+ *    negative sbrk or mem_reset_brk are zero again.
+ */
+void *mem_region_clean(int region) {
+    return (void *) region_clean[region];
+}
+
+/*
+ * page_up - round p up to a page boundary
+ */
+static char *page_up(char *p) {
+    size_t mask = mem_pagesize() - 1;
+    return (char *) (((size_t) p + mask) & ~mask);
+}
+
+/*
+ * mem_region_of - return the region that contains heap address p
+ */
+int mem_region_of(void *p) {
+    int region = ((char *) p - mem_start_brk) / region_span;
+    return (region < num_regions) ? region : num_regions - 1;
+}
+
+/*
+ * mem_region_hi - return address of the last byte of a region
+ */
+void *mem_region_hi(int region) {
+    return (void *) (region_brk[region] - 1);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -75,14 +399,38 @@ void *mem_heap_lo() {
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi() {
-    return (void *) (mem_brk - 1);
+    int i;
+
+    /* the highest region that is not empty holds the last byte */
+    for (i = num_regions - 1; i > 0; i--)
+        if (region_brk[i] != mem_start_brk + i * region_span)
+            break;
+    return (void *) (region_brk[i] - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, mappings included
  */
 size_t mem_heapsize() {
-    return (size_t) (mem_brk - mem_start_brk);
+    int i;
+    size_t size = 0;
+    mapping_t *m;
+
+    for (i = 0; i < num_regions; i++)
+        size += region_brk[i] - (mem_start_brk + i * region_span);
+    pthread_mutex_lock(&mem_lock);
+    for (m = mappings; m != NULL; m = m->next)
+        size += m->len;
+    pthread_mutex_unlock(&mem_lock);
+    return size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since
+ *    the last reset; the heap can shrink, so this is the high water mark
+ */
+size_t mem_peak_heapsize() {
+    return mem_peak;
 }
 
 /*
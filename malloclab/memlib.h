@@ -1,11 +1,25 @@
 #include <unistd.h>
 
+#define MAX_REGIONS 64  /* most regions the heap can be split into */
+
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
+void mem_reset_heap(void);
+void mem_set_regions(int n);
+void *mem_region_sbrk(int region, int incr);
+int mem_region_of(void *p);
+void *mem_region_hi(int region);
+void *mem_region_clean(int region);
+void *mem_map(size_t len);
+void mem_unmap(void *lo);
+void *mem_remap(void *lo, size_t len);
+int mem_contains(void *lo, void *hi);
+void mem_release(void *lo, size_t len);
+size_t mem_resident(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
-
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -13,11 +18,198 @@
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
 
+/*
+ * Compact free blocks, enabled with USE_COMPACT=1. Free-list links are stored
+ * as 32-bit offsets from mem_heap_lo() instead of pointers, so a free block is
+ * only a header, two links and a footer and the minimum block drops from
+ * 2*ALIGNMENT to 16 bytes. Offset 0 lies in the free list area and means null.
+ */
+#ifndef USE_COMPACT
+#define USE_COMPACT 0
+#endif
+
 // basic constants
 #define WORD_SIZE   4
 #define DOUBLE_SIZE 8
 #define CHUNK_SIZE  (1 << 12)  // 4096 bytes
+#define SORT_MAP_WORDS 4096    // mm_free_batch sorts batches spanning up to 2 MB in a bitmap
+#define SORT_SMALL  16         // ... and batches this small by insertion
+#if USE_COMPACT
+#define LINK_SIZE   WORD_SIZE
+#define MIN_BLOCK   (2 * DOUBLE_SIZE)
+#else
+#define LINK_SIZE   SIZE_T_SIZE
+#define MIN_BLOCK   (2 * ALIGNMENT)
+#endif
+
+/*
+ * Free list policy, picked at compile time (make MMFLAGS=-DUSE_LIFO=1).
+ * 0: power-of-two buckets, each bucket kept in address order.
+ * 1: constant-time LIFO insertion into finer size classes; one exact class
+ *    per 8-byte block size below EXACT_LIMIT, then two classes per power of two.
+ */
+#ifndef USE_LIFO
+#define USE_LIFO 0
+#endif
+
+#if USE_LIFO
+#define BUCKET_NUM  64
+#define EXACT_NUM   ((256 - MIN_BLOCK) / DOUBLE_SIZE)  // block sizes MIN_BLOCK, ..., 248
+#define EXACT_LIMIT (MIN_BLOCK + EXACT_NUM * DOUBLE_SIZE)
+#else
 #define BUCKET_NUM  16
+#endif
+
+#if BUCKET_NUM > 64
+#error "bucket_map holds at most 64 size classes"
+#endif
+
+// free-byte classes reported by mm_stats: one per free list, plus the tree
+#define STAT_CLASSES (BUCKET_NUM + 1)
+#define TREE_CLASS   BUCKET_NUM
+
+#if STAT_CLASSES > MM_STAT_CLASSES
+#error "struct mm_stats has too few classes"
+#endif
+
+/*
+ * Small-object slab layer, enabled with USE_SLAB=1. Requests of at most
+ * SLAB_MAX bytes are carved from page-sized runs of same-size objects that
+ * have no per-object header. Each run is an ordinary allocated block whose
+ * payload is page aligned, so a pointer maps to its run by masking, and
+ * slab_pages records which heap pages are runs.
+ */
+#ifndef USE_SLAB
+#define USE_SLAB 0
+#endif
+
+#define SLAB_MAX       256
+#define SLAB_CLASSES   (SLAB_MAX / DOUBLE_SIZE)     // objects of 8, 16, ..., 256 bytes
+#define RUN_SIZE       CHUNK_SIZE
+#define RUN_MAP_WORDS  8                            // enough bits for 8-byte objects
+#define SLAB_MAP_PAGES (1 << 15)                    // runs must lie in the first 128 MB
+
+/*
+ * Best-fit index for large free blocks, enabled with USE_TREE=1. Free blocks
+ * of at least TREE_MIN bytes are kept in a top-down splay tree keyed by
+ * (size, address) instead of the segregated lists; the child links reuse
+ * the PREV_NODE/NEXT_NODE words of the free block.
+ */
+#ifndef USE_TREE
+#define USE_TREE 0
+#endif
+
+#define TREE_MIN (1 << 12)
+
+/*
+ * Thread-safe build, enabled with USE_THREADS=1. Each arena (see below) is
+ * guarded by its own lock. Each thread keeps a cache of recently freed small blocks per
+ * size class, still marked allocated in the heap, and only takes the lock to
+ * refill or flush a class CACHE_BATCH blocks at a time.
+ */
+#ifndef USE_THREADS
+#define USE_THREADS 0
+#endif
+
+#define CACHE_MAX     1024   // largest request served from a thread cache
+#define CACHE_CLASSES (CACHE_MAX / DOUBLE_SIZE + 1)
+#define CACHE_COUNT   16     // blocks a class holds before it is flushed
+#define CACHE_BATCH   8      // blocks moved between a cache and the heap per lock
+
+/*
+ * Number of independent arenas. Each arena has its own free lists,
+ * prologue/epilogue and lock, and grows into its own memlib region.
+ * Threads are assigned to arenas round-robin, or by the CPU they run on
+ * with ARENA_BY_CPU=1; a block is always freed into the arena that owns it.
+ */
+#ifndef ARENA_NUM
+#define ARENA_NUM 1
+#endif
+
+#ifndef ARENA_BY_CPU
+#define ARENA_BY_CPU 0
+#endif
+
+#if ARENA_NUM > 1 && !USE_THREADS
+#error "multiple arenas need USE_THREADS=1"
+#endif
+
+/*
+ * Give memory back, enabled with USE_TRIM=1. Every TRIM_INTERVAL frees (or
+ * more, on a heap of more blocks than that) the heap is swept for free blocks
+ * of at least TRIM_THRESHOLD bytes. One that was already free, at the same
+ * place and size, at the previous sweep is given back: the heap is shrunk if
+ * it is the last block, keeping CHUNK_SIZE bytes, and otherwise its interior
+ * pages are handed to mem_release. A block that is reused soon after it is
+ * freed thus keeps its pages, and the sweep remembers up to TRIM_SLOTS
+ * released blocks so that their pages are not released again. Pages are only
+ * really returned with the mmap memlib backend.
+ */
+#ifndef USE_TRIM
+#define USE_TRIM 0
+#endif
+
+#define TRIM_THRESHOLD (16 * CHUNK_SIZE)
+#define TRIM_INTERVAL  1024   // frees between sweeps of the heap
+#define TRIM_SLOTS     64     // large free blocks a sweep remembers
+
+/*
+ * Huge blocks, enabled with USE_MMAP=1. A request of at least MMAP_THRESHOLD
+ * bytes gets its own mapping from mem_map instead of coming out of the heap.
+ * The mapping starts with its length, and the payload, ALIGNMENT bytes in,
+ * has a header of size 0 marked allocated, which no heap block can have.
+ * Reallocating such a block resizes the mapping with mem_remap, so the
+ * contents are never copied.
+ */
+#ifndef USE_MMAP
+#define USE_MMAP 0
+#endif
+
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (32 * CHUNK_SIZE)
+#endif
+
+/*
+ * Deferred coalescing, enabled with USE_DEFER=1. A freed block of at most
+ * QUICK_MAX bytes stays marked allocated and goes onto a quick list of blocks
+ * of exactly its size, where the next request of that size finds it. The
+ * blocks are only really freed and coalesced by a sweep, which runs when
+ * find_fit fails or a quick list holds more than QUICK_COUNT blocks.
+ */
+#ifndef USE_DEFER
+#define USE_DEFER 0
+#endif
+
+#define QUICK_MAX     512
+#define QUICK_CLASSES (QUICK_MAX / DOUBLE_SIZE + 1)
+#define QUICK_COUNT   64
+
+/*
+ * Realloc headroom, enabled with USE_HEADROOM=1. A block that grows through
+ * realloc is marked with the GROWN bit. When a marked block has to grow
+ * again and must move to do so, it gets HEADROOM_NUM/HEADROOM_DEN times the
+ * requested size, and shrinking it by less than half keeps the spare room, so
+ * the following steps of a growing buffer stay in place. A block recycled
+ * through a quick list or thread cache may keep the bit; it is only a hint.
+ */
+#ifndef USE_HEADROOM
+#define USE_HEADROOM 0
+#endif
+
+#define HEADROOM_NUM 3
+#define HEADROOM_DEN 2
+
+/*
+ * Zero tracking for mm_calloc, enabled with USE_ZERO=1. A free block whose
+ * payload is known to read as zero, apart from its own links and footer,
+ * carries the ZEROED bit. Such blocks come from heap memory above the
+ * region's clean frontier (see mem_region_clean), keep the bit through
+ * splits and merges with other zeroed blocks, and lose it once freed by
+ * the user. mm_calloc only clears the few tag words of a zeroed block.
+ */
+#ifndef USE_ZERO
+#define USE_ZERO 0
+#endif
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -34,12 +226,16 @@
 #define CURR_ALLOC(p) (GET(p) & 0x1)   // last bit
 #define PREV_ALLOC(p) (GET(p) & 0x2)   // second-last bit
 #define ALLOC_BITS(p) (GET(p) & 0x3)   // last two bits
+#define GROWN(p)      (GET(p) & 0x4)   // allocated block was grown by realloc
+#define ZEROED(p)     (GET(p) & 0x4)   // free block reads as zero
 
 // set allocated bits
 #define SET_CURR_ALLOC(p) (GET(p) |= 0x1)
 #define SET_PREV_ALLOC(p) (GET(p) |= 0x2)
 #define SET_CURR_FREE(p)  (GET(p) &= ~0x1)
 #define SET_PREV_FREE(p)  (GET(p) &= ~0x2)
+#define SET_GROWN(p)      (GET(p) |= 0x4)
+#define SET_ZEROED(p)     (GET(p) |= 0x4)
 
 // used for pointer arithmetic
 #define BLOCK_PTR(bp) ((char *)(bp))
@@ -53,22 +249,200 @@
 #define PREV_BLOCK(bp) (BLOCK_PTR(bp) - BLOCK_SIZE((BLOCK_PTR(bp) - DOUBLE_SIZE)))
 
 // doubly linked list
+#if USE_COMPACT
+#define TO_PTR(off)    ((off) ? (void *) (heap_base + (off)) : NULL)
+#define TO_OFFSET(ptr) ((ptr) ? (uint32_t) ((char *)(ptr) - heap_base) : 0)
+#define PREV_NODE(bp)  TO_PTR(GET(bp))
+#define NEXT_NODE(bp)  TO_PTR(GET(BLOCK_PTR(bp) + LINK_SIZE))
+#define SET_PREV_NODE(bp, val)   PUT(bp, TO_OFFSET(val))
+#define SET_NEXT_NODE(bp, val)   PUT(BLOCK_PTR(bp) + LINK_SIZE, TO_OFFSET(val))
+#else
 #define PREV_NODE(bp)  ((void *) (*(size_t *) ((char *)(bp))))
-#define NEXT_NODE(bp)  ((void *) (*(size_t *) ((char *)(bp) + SIZE_T_SIZE)))
+#define NEXT_NODE(bp)  ((void *) (*(size_t *) ((char *)(bp) + LINK_SIZE)))
 #define SET_PREV_NODE(bp, val)   (*(size_t *) ((char *)(bp)) = (size_t)(val))
-#define SET_NEXT_NODE(bp, val)   (*(size_t *) ((char *)(bp) + SIZE_T_SIZE) = (size_t)(val))
+#define SET_NEXT_NODE(bp, val)   (*(size_t *) ((char *)(bp) + LINK_SIZE) = (size_t)(val))
+#endif
+
+// block size that holds a payload of size bytes
+#if USE_COMPACT
+#define BLOCK_FOR(size) MAX(ALIGN((size) + WORD_SIZE), MIN_BLOCK)
+#else
+#define BLOCK_FOR(size) ((size) <= ALIGNMENT ? MIN_BLOCK : ALIGN((size) + WORD_SIZE))
+#endif
+
+// splay tree children, stored where list nodes keep their links
+#define LEFT_NODE(bp)  PREV_NODE(bp)
+#define RIGHT_NODE(bp) NEXT_NODE(bp)
+#define SET_LEFT_NODE(bp, val)  SET_PREV_NODE(bp, val)
+#define SET_RIGHT_NODE(bp, val) SET_NEXT_NODE(bp, val)
+
+// deferred blocks are linked through their first payload word
+#define QUICK_NEXT(bp) (*(void **) (bp))
+
+#if USE_SLAB
+// header at the start of every run; objects follow it
+typedef struct slab_run {
+    struct slab_run *prev;   // runs of the same class with free slots
+    struct slab_run *next;
+    uint32_t obj_size;
+    uint16_t slot_num;
+    uint16_t free_num;
+    uint64_t free_map[RUN_MAP_WORDS];  // bit set = slot is free
+} slab_run;
+
+#define SLAB_CLASS(size)  (((size) + DOUBLE_SIZE - 1) / DOUBLE_SIZE - 1)
+#define RUN_OF(ptr)       ((slab_run *) ((size_t)(ptr) & ~(size_t)(RUN_SIZE - 1)))
+#define RUN_SLOT(run, i)  ((char *)(run) + sizeof(slab_run) + (size_t)(i) * (run)->obj_size)
+#define PAGE_INDEX(ptr)   (((size_t)(ptr) / RUN_SIZE) - slab_base)
+
+// byte i is set iff heap page i (counted from slab_base) is a run
+static uint8_t slab_pages[SLAB_MAP_PAGES];
+static size_t slab_base;
+
+static void *slab_malloc(size_t size);
+static void slab_free(void *ptr);
+static size_t slab_malloc_batch(size_t size, size_t n, void **out);
+static void slab_free_batch(void **ptrs, size_t n);
+static inline int is_slab(void *ptr);
+#endif
+
+#if USE_MMAP
+// length of the mapping that holds the huge block bp
+#define MAP_LENGTH(bp) (*(size_t *) (BLOCK_PTR(bp) - ALIGNMENT))
+
+static void *map_malloc(size_t size);
+static void map_free(void *ptr);
+static void *map_realloc(void *ptr, size_t size);
+static inline int is_mapped(void *ptr);
+#endif
+
+#if USE_TREE
+static void *splay(void *root, size_t size, void *bp);
+static void tree_insert(void *bp);
+static void tree_remove(void *bp);
+static void *tree_best_fit(size_t align_size);
+#endif
+
+#if USE_TRIM
+// a large free block seen by the last trim_sweep
+typedef struct {
+    char *bp;
+    size_t size;
+    int released;                    // its pages were released
+} trim_slot;
+#endif
+
+// one independent heap
+typedef struct {
+    char *heap_list;                 // always points to the prologue block
+    void *free_lists[BUCKET_NUM];    // segregated free lists
+    uint64_t bucket_map;             // bit n is set iff free_lists[n] is non-empty
+#if USE_TREE
+    void *tree_root;                 // root of the splay tree of large free blocks
+#endif
+#if USE_SLAB
+    slab_run *slab_lists[SLAB_CLASSES];  // runs with a free slot, one list per object size
+#endif
+#if USE_DEFER
+    void *quick_lists[QUICK_CLASSES];    // class n holds deferred blocks of n * 8 bytes
+    int quick_counts[QUICK_CLASSES];
+    int quick_total;                     // blocks on all quick lists
+#endif
+#if USE_TRIM
+    trim_slot trim_seen[TRIM_SLOTS];  // large free blocks at the last sweep, by address
+    int trim_count;
+    size_t trim_frees;               // frees since the last sweep
+    size_t trim_due;                 // frees that make the next sweep due
+#endif
+    int region;                      // memlib region the arena grows into
+#if USE_THREADS
+    pthread_mutex_t lock;
+#endif
+    // telemetry for mm_stats, kept up to date under the arena lock
+    size_t free_bytes[STAT_CLASSES];  // bytes on each free list, then in the tree
+    unsigned long splits;             // free blocks split by an allocation
+    unsigned long coalesces;          // free blocks merged into a neighbour
+    unsigned long fit_calls;          // find_fit searches
+    unsigned long fit_steps;          // free blocks those searches looked at
+} arena_t;
 
-// global variable, always points to the prologue block
-static char* heap_list = 0;
+static arena_t arenas[ARENA_NUM];
 
-// segregated free lists
-static void* free_lists[BUCKET_NUM];
+#if USE_COMPACT
+static char *heap_base;  // free-list offsets are relative to this
+#endif
+
+// the arena the heap_* routines operate on
+#if USE_THREADS
+static __thread arena_t *arena = &arenas[0];
+#else
+static arena_t *arena = &arenas[0];
+#endif
+
+// mdriver -T only runs against a thread-safe build
+const int mm_thread_safe = USE_THREADS;
+
+// grow the current arena's region of the heap
+#define ARENA_SBRK(incr) mem_region_sbrk(arena->region, (incr))
+
+#if USE_THREADS
+typedef struct {
+    unsigned epoch;              // heap_epoch the cached blocks belong to
+    int registered;              // exit destructor installed for this thread
+    void *lists[CACHE_CLASSES];  // class n holds blocks with n * 8 usable bytes or more
+    int counts[CACHE_CLASSES];
+} thread_cache;
+
+// cached blocks are linked through their first payload word
+#define CACHE_NEXT(bp) (*(void **) (bp))
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static unsigned heap_epoch = 0;  // bumped by mm_init to invalidate every cache
+static __thread thread_cache cache;
+static __thread arena_t *home = 0;   // arena this thread allocates from
+#if !ARENA_BY_CPU
+static unsigned next_arena = 0;      // round-robin arena assignment
+#endif
+
+static arena_t *home_arena(void);
+static void *arena_malloc(size_t size);
+static inline arena_t *owner_arena(void *ptr);
+
+static thread_cache *get_cache(void);
+static void cache_refill(thread_cache *tc, int class);
+static void cache_flush(thread_cache *tc, int class, int count);
+#endif
 
 // function prototypes
+static int heap_init(void);
+static void *heap_malloc(size_t size);
+static void heap_free(void *ptr);
+static void *heap_realloc(void *ptr, size_t size);
+static void *heap_memalign(size_t alignment, size_t size);
+static size_t heap_malloc_batch(size_t size, size_t n, void **out);
+static void heap_free_batch(void **ptrs, size_t n);
+#if USE_ZERO
+static void *heap_calloc(size_t size);
+static inline void clear_tags(void *bp);
+#endif
 static void *extend_heap(size_t bytes);
+static void free_block(void *ptr);
 static void *coalesce(void *bp);
+#if USE_DEFER
+static int sweep(void);
+#endif
+#if USE_TRIM
+static void trim_sweep(int all);
+#endif
+#if USE_HEADROOM
+static inline int has_header(size_t size);
+#endif
 static void *find_fit(size_t align_size);
+static size_t largest_free(arena_t *a);
 static void place(void *ptr, size_t align_size);
+static size_t place_batch(void *ptr, size_t align_size, size_t n, void **out);
+static void *place_aligned(size_t align_size, size_t alignment);
 static inline void insert_node(void *bp, size_t size);
 static inline void remove_node(void *bp);
 
@@ -81,23 +455,510 @@ static void check_freelist();
  * @return 0 if okay, -1 if there was a problem in performing the initialization.
  */
 int mm_init(void) {
+    int result = 0;
+#if ARENA_NUM > 1
+    mem_set_regions(ARENA_NUM);
+#endif
+#if USE_THREADS
+    heap_epoch++;
+#endif
+#if USE_SLAB
+    memset(slab_pages, 0, sizeof(slab_pages));
+    slab_base = (size_t) mem_heap_lo() / RUN_SIZE;
+#endif
+#if USE_COMPACT
+    heap_base = mem_heap_lo();
+#endif
+    for (int i = 0; i < ARENA_NUM; i++) {
+        arena = &arenas[i];
+        arena->region = i;
+#if USE_THREADS
+        pthread_mutex_init(&arena->lock, NULL);
+#endif
+        if (heap_init() < 0) {
+            result = -1;
+        }
+    }
+    arena = &arenas[0];
+    return result;
+}
+
+/**
+ * Allocate a block of memory of at least size bytes.
+ */
+void *mm_malloc(size_t size) {
+#if USE_THREADS
+    void *bp;
+    if (size > 0 && size <= CACHE_MAX) {
+        thread_cache *tc = get_cache();
+        int class = (size + DOUBLE_SIZE - 1) / DOUBLE_SIZE;
+        if (tc->lists[class] == 0) {
+            cache_refill(tc, class);
+        }
+        if ((bp = tc->lists[class]) != 0) {
+            tc->lists[class] = CACHE_NEXT(bp);
+            tc->counts[class]--;
+            return bp;
+        }
+    }
+    return arena_malloc(size);
+#else
+    return heap_malloc(size);
+#endif
+}
+
+/**
+ * Free the memory block pointed to by ptr; return nothing.
+ */
+void mm_free(void *ptr) {
+#if USE_THREADS
+    if (ptr == NULL) {
+        return;
+    }
+    int class = mm_usable_size(ptr) / DOUBLE_SIZE;
+    if (class < CACHE_CLASSES) {
+        thread_cache *tc = get_cache();
+        CACHE_NEXT(ptr) = tc->lists[class];
+        tc->lists[class] = ptr;
+        if (++tc->counts[class] > CACHE_COUNT) {
+            cache_flush(tc, class, CACHE_BATCH);
+        }
+        return;
+    }
+#if USE_MMAP
+    if (is_mapped(ptr)) {
+        map_free(ptr);
+        return;
+    }
+#endif
+    arena_t *owner = owner_arena(ptr);
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+    heap_free(ptr);
+    pthread_mutex_unlock(&owner->lock);
+#else
+    heap_free(ptr);
+#endif
+}
+
+/**
+ * Allocate n blocks of at least size bytes each into out. The blocks are
+ * carved side by side out of as few free blocks as possible, so the free
+ * lists are updated once per free block used rather than once per block.
+ * @return the number of blocks allocated, less than n only if the heap is full.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    if (n == 1) {
+        return (out[0] = mm_malloc(size)) != NULL;
+    }
+#if USE_THREADS
+    if (size > 0 && size <= CACHE_MAX) {
+        // the thread cache already refills in batches, without the lock
+        size_t count = 0;
+        for (; count < n && (out[count] = mm_malloc(size)) != NULL; count++);
+        return count;
+    }
+    arena_t *a = home_arena();
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+    size_t count = heap_malloc_batch(size, n, out);
+    pthread_mutex_unlock(&a->lock);
+    // the rest may still fit in another arena
+    for (; count < n && (out[count] = arena_malloc(size)) != NULL; count++);
+    return count;
+#else
+    return heap_malloc_batch(size, n, out);
+#endif
+}
+
+// order pointers by address for sort_ptrs
+static int compare_ptrs(const void *a, const void *b) {
+    size_t x = (size_t) *(void **) a;
+    size_t y = (size_t) *(void **) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sort ptrs by address, null pointers first. Up to SORT_SMALL pointers are
+ * sorted by insertion. The blocks of a larger batch usually
+ * lie close together, so they are marked in a bitmap over the span they
+ * cover and read back in order, which takes linear time. A batch spread
+ * over more than SORT_MAP_WORDS * 64 granules of 8 bytes, or sparse enough
+ * that the bitmap would cost more than the pointers, goes to qsort.
+ */
+static void sort_ptrs(void **ptrs, size_t n) {
+    if (n <= SORT_SMALL) {
+        for (size_t i = 1; i < n; i++) {
+            void *p = ptrs[i];
+            size_t j = i;
+            for (; j > 0 && (size_t) ptrs[j - 1] > (size_t) p; j--) {
+                ptrs[j] = ptrs[j - 1];
+            }
+            ptrs[j] = p;
+        }
+        return;
+    }
+    uint64_t map[SORT_MAP_WORDS];
+    size_t lo = SIZE_MAX, hi = 0, nulls = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t p = (size_t) ptrs[i];
+        if (p == 0) {
+            nulls++;
+            continue;
+        }
+        lo = MIN(lo, p);
+        hi = MAX(hi, p);
+    }
+    if (nulls == n) {
+        return;
+    }
+    size_t words = ((hi - lo) / DOUBLE_SIZE) / 64 + 1;
+    if (words > SORT_MAP_WORDS || words > 16 * n) {
+        qsort(ptrs, n, sizeof(void *), compare_ptrs);
+        return;
+    }
+
+    memset(map, 0, words * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            size_t g = ((size_t) ptrs[i] - lo) / DOUBLE_SIZE;
+            map[g / 64] |= (uint64_t) 1 << (g % 64);
+        }
+    }
+    // a pointer passed twice comes back once; the slots left over are null
+    size_t k = 0;
+    for (; k < nulls; k++) {
+        ptrs[k] = NULL;
+    }
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = map[w]; bits != 0; bits &= bits - 1) {
+            ptrs[k++] = (void *) (lo + (w * 64 + __builtin_ctzll(bits)) * DOUBLE_SIZE);
+        }
+    }
+    size_t extra = n - k;
+    if (extra > 0) {
+        memmove(ptrs + extra, ptrs, k * sizeof(void *));
+        memset(ptrs, 0, extra * sizeof(void *));
+    }
+}
+
+/**
+ * Free the n blocks in ptrs, which may include null pointers. Heap blocks
+ * are sorted by address so that neighbouring blocks are merged in one pass
+ * and each run of them is coalesced with the heap only once.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    if (n == 1) {
+        mm_free(ptrs[0]);
+        return;
+    }
+#if USE_THREADS || USE_SLAB
+    // blocks the thread cache takes and slab objects, which are freed by
+    // clearing a bit, gain nothing from sorting, and mappings belong to no
+    // arena; only the other heap blocks are left in the array
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL) {
+            continue;
+        }
+#if USE_THREADS
+        if (mm_usable_size(ptr) / DOUBLE_SIZE < CACHE_CLASSES) {
+            mm_free(ptr);
+            continue;
+        }
+#if USE_MMAP
+        if (is_mapped(ptr)) {
+            map_free(ptr);
+            continue;
+        }
+#endif
+#else
+        if (is_slab(ptr)) {
+            slab_free(ptr);
+            continue;
+        }
+#endif
+        ptrs[m++] = ptr;
+    }
+    n = m;
+#endif
+    sort_ptrs(ptrs, n);
+#if USE_THREADS
+    // arena regions are contiguous, so each arena's blocks form one slice
+    size_t i = 0;
+    while (i < n && ptrs[i] == NULL) {
+        i++;
+    }
+    while (i < n) {
+        arena_t *owner = owner_arena(ptrs[i]);
+        size_t j = i + 1;
+        while (j < n && owner_arena(ptrs[j]) == owner) {
+            j++;
+        }
+        pthread_mutex_lock(&owner->lock);
+        arena = owner;
+        heap_free_batch(ptrs + i, j - i);
+        pthread_mutex_unlock(&owner->lock);
+        i = j;
+    }
+#else
+    heap_free_batch(ptrs, n);
+#endif
+}
+
+/**
+ * Allocate a block of at least size bytes whose address is a multiple of
+ * alignment, which must be a power of two.
+ * @return the block, or null pointer if alignment is invalid or the heap is full.
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= DOUBLE_SIZE) {
+        return mm_malloc(size);
+    }
+#if USE_THREADS
+    arena_t *a = home_arena();
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+    void *bp = heap_memalign(alignment, size);
+    pthread_mutex_unlock(&a->lock);
+    return bp;
+#else
+    return heap_memalign(alignment, size);
+#endif
+}
+
+/**
+ * C11 spelling of mm_memalign.
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
+
+/**
+ * Allocate a zeroed array of nmemb elements of size bytes each.
+ * @return the block, or null pointer if the size overflows or the heap is full.
+ */
+void *mm_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    size_t bytes = nmemb * size;
+    void *bp;
+#if USE_ZERO
+    // small requests come from slabs or thread caches, where clearing is cheap anyway
+#if USE_THREADS
+    if (bytes > CACHE_MAX) {
+        arena_t *a = home_arena();
+        pthread_mutex_lock(&a->lock);
+        arena = a;
+        bp = heap_calloc(bytes);
+        pthread_mutex_unlock(&a->lock);
+        if (bp != NULL) {
+            return bp;
+        }
+    }
+#else
+    if (bytes > SLAB_MAX || !USE_SLAB) {
+        return heap_calloc(bytes);
+    }
+#endif
+#endif
+    if ((bp = mm_malloc(bytes)) != NULL) {
+        memset(bp, 0, bytes);
+    }
+    return bp;
+}
+
+/**
+ * @return the number of bytes the caller may use in the allocated block ptr,
+ *         which can be more than it asked for.
+ */
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+#if USE_SLAB
+    if (is_slab(ptr)) {
+        return RUN_OF(ptr)->obj_size;
+    }
+#endif
+#if USE_MMAP
+    if (is_mapped(ptr)) {
+        return MAP_LENGTH(ptr) - ALIGNMENT;
+    }
+#endif
+    return BLOCK_SIZE(HEADER(ptr)) - WORD_SIZE;
+}
+
+/**
+ * Give back the memory of every large free block now instead of when it has
+ * stayed free for a sweep. Does nothing unless mm.c is built with USE_TRIM=1.
+ */
+void mm_trim(void) {
+#if USE_TRIM
+    for (int i = 0; i < ARENA_NUM; i++) {
+#if USE_THREADS
+        pthread_mutex_lock(&arenas[i].lock);
+#endif
+        arena = &arenas[i];
+        if (arena->heap_list != 0) {
+            trim_sweep(1);
+        }
+#if USE_THREADS
+        pthread_mutex_unlock(&arenas[i].lock);
+#endif
+    }
+#endif
+}
+
+/**
+ * Fill in st with the current heap telemetry of every arena. Blocks on
+ * quick lists and thread caches count as in use. Only the largest free
+ * block is looked for; everything else is kept up to date as the heap
+ * changes, so this is cheap enough to call at any time.
+ */
+void mm_stats(struct mm_stats *st) {
+    memset(st, 0, sizeof(*st));
+    st->classes = STAT_CLASSES;
+    unsigned long fit_steps = 0;
+    for (int i = 0; i < ARENA_NUM; i++) {
+        arena_t *a = &arenas[i];
+#if USE_THREADS
+        pthread_mutex_lock(&a->lock);
+#endif
+        for (int n = 0; n < STAT_CLASSES; n++) {
+            st->class_free[n] += a->free_bytes[n];
+            st->free_bytes += a->free_bytes[n];
+        }
+        st->largest_free = MAX(st->largest_free, largest_free(a));
+        st->splits += a->splits;
+        st->coalesces += a->coalesces;
+        st->fit_calls += a->fit_calls;
+        fit_steps += a->fit_steps;
+#if USE_THREADS
+        pthread_mutex_unlock(&a->lock);
+#endif
+    }
+    st->heap_bytes = mem_heapsize();
+    st->used_bytes = st->heap_bytes - st->free_bytes;
+    if (st->free_bytes > 0) {
+        st->fragmentation = 1.0 - (double) st->largest_free / st->free_bytes;
+    }
+    if (st->fit_calls > 0) {
+        st->avg_search = (double) fit_steps / st->fit_calls;
+    }
+}
+
+/**
+ * Write a snapshot of the heap to fp: a line "snap <label> <heap bytes>",
+ * then a line "<offset> <bytes> a|f" for each run of adjacent allocated or
+ * free blocks, offsets counted from mem_heap_lo(). Each arena is walked from
+ * its prologue to its epilogue, so the free list area and huge mappings are
+ * left out; slab runs and blocks on quick lists or thread caches are
+ * allocated as far as the heap knows, and show as such.
+ */
+void mm_snapshot(FILE *fp, long label) {
+    char *lo = mem_heap_lo();
+    fprintf(fp, "snap %ld %zu\n", label, mem_heapsize());
+    for (int i = 0; i < ARENA_NUM; i++) {
+        arena_t *a = &arenas[i];
+#if USE_THREADS
+        pthread_mutex_lock(&a->lock);
+#endif
+        if (a->heap_list != 0) {
+            char *bp = NEXT_BLOCK(a->heap_list);
+            while (BLOCK_SIZE(HEADER(bp)) != 0) {
+                char *run = bp;
+                int alloc = CURR_ALLOC(HEADER(bp));
+                while (BLOCK_SIZE(HEADER(bp)) != 0 && CURR_ALLOC(HEADER(bp)) == alloc) {
+                    bp = NEXT_BLOCK(bp);
+                }
+                fprintf(fp, "%td %td %c\n", HEADER(run) - lo, bp - run, alloc ? 'a' : 'f');
+            }
+        }
+#if USE_THREADS
+        pthread_mutex_unlock(&a->lock);
+#endif
+    }
+}
+
+/**
+ * Resize the block pointed to by ptr to size bytes; see heap_realloc.
+ */
+void *mm_realloc(void *ptr, size_t size) {
+#if USE_THREADS
+    if (ptr == NULL) {
+        return mm_malloc(size);
+    }
+#if USE_MMAP
+    if (is_mapped(ptr)) {
+        if (size == 0) {
+            map_free(ptr);
+            return NULL;
+        }
+        return map_realloc(ptr, size);
+    }
+#endif
+    // the block stays in the arena that owns it
+    arena_t *owner = owner_arena(ptr);
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+    void *new_ptr = heap_realloc(ptr, size);
+    pthread_mutex_unlock(&owner->lock);
+    return new_ptr;
+#else
+    return heap_realloc(ptr, size);
+#endif
+}
+
+/**
+ * Set up an empty heap in the current arena: the free list area, prologue,
+ * epilogue and a first free chunk.
+ * @return 0 if okay, -1 if mem_sbrk failed.
+ */
+static int heap_init(void) {
     // initialize segregated free lists
-    if ((heap_list = mem_sbrk(BUCKET_NUM * SIZE_T_SIZE)) == (void *) -1) {
+    if ((arena->heap_list = ARENA_SBRK(BUCKET_NUM * SIZE_T_SIZE)) == (void *) -1) {
         return -1;
     }
     for (int i = 0; i < BUCKET_NUM; i++) {
-        free_lists[i] = 0;
+        arena->free_lists[i] = 0;
     }
+    arena->bucket_map = 0;
+#if USE_TREE
+    arena->tree_root = 0;
+#endif
+    memset(arena->free_bytes, 0, sizeof(arena->free_bytes));
+    arena->splits = arena->coalesces = 0;
+    arena->fit_calls = arena->fit_steps = 0;
+
+#if USE_SLAB
+    memset(arena->slab_lists, 0, sizeof(arena->slab_lists));
+#endif
+#if USE_TRIM
+    arena->trim_count = 0;
+    arena->trim_frees = 0;
+    arena->trim_due = TRIM_INTERVAL;
+#endif
+#if USE_DEFER
+    memset(arena->quick_lists, 0, sizeof(arena->quick_lists));
+    memset(arena->quick_counts, 0, sizeof(arena->quick_counts));
+    arena->quick_total = 0;
+#endif
 
     // create initial heap with empty free list
-    if ((heap_list = mem_sbrk(4 * WORD_SIZE)) == (void *) -1) {
+    if ((arena->heap_list = ARENA_SBRK(4 * WORD_SIZE)) == (void *) -1) {
         return -1;
     }
-    PUT(heap_list, 0);
-    PUT(heap_list + (1 * WORD_SIZE), PACK(DOUBLE_SIZE, 1));  // header
-    PUT(heap_list + (2 * WORD_SIZE), PACK(DOUBLE_SIZE, 1));  // footer
-    PUT(heap_list + (3 * WORD_SIZE), PACK(0, 3));            // epilogue
-    heap_list += DOUBLE_SIZE;
+    PUT(arena->heap_list, 0);
+    PUT(arena->heap_list + (1 * WORD_SIZE), PACK(DOUBLE_SIZE, 1));  // header
+    PUT(arena->heap_list + (2 * WORD_SIZE), PACK(DOUBLE_SIZE, 1));  // footer
+    PUT(arena->heap_list + (3 * WORD_SIZE), PACK(0, 3));            // epilogue
+    arena->heap_list += DOUBLE_SIZE;
 
     // extend heap size
     if (extend_heap(CHUNK_SIZE) == NULL)
@@ -106,30 +967,52 @@ int mm_init(void) {
 }
 
 /**
- * Allocate a block of memory of at least size bytes.
+ * Allocate a block of memory of at least size bytes from the shared heap.
  * Always allocate a block whose size is a multiple of the alignment.
  */
-void *mm_malloc(size_t size) {
+static void *heap_malloc(size_t size) {
     if (size == 0) {
         return NULL;
     }
-    if (heap_list == 0) {
-        mm_init();
+    if (arena->heap_list == 0) {
+        heap_init();
     }
 
-    // adjust size to include overhead, round up to be multiples of 8 bytes
     char *bp;
-    size_t align_size;
-    if (size <= ALIGNMENT) {
-        align_size = 2 * ALIGNMENT;
-    } else {
-        align_size = ALIGN(size + WORD_SIZE);
+#if USE_SLAB
+    if (size <= SLAB_MAX && (bp = slab_malloc(size)) != NULL) {
+        return bp;
     }
+#endif
+#if USE_MMAP
+    if (size >= MMAP_THRESHOLD) {
+        return map_malloc(size);
+    }
+#endif
+
+    // adjust size to include overhead, round up to be multiples of 8 bytes
+    size_t align_size = BLOCK_FOR(size);
+
+#if USE_DEFER
+    if (align_size <= QUICK_MAX && (bp = arena->quick_lists[align_size / DOUBLE_SIZE]) != NULL) {
+        arena->quick_lists[align_size / DOUBLE_SIZE] = QUICK_NEXT(bp);
+        arena->quick_counts[align_size / DOUBLE_SIZE]--;
+        arena->quick_total--;
+        return bp;
+    }
+#endif
 
     if ((bp = find_fit(align_size)) != NULL) {
         place(bp, align_size);
         return bp;
     }
+#if USE_DEFER
+    // merge the deferred blocks before growing the heap
+    if (sweep() > 0 && (bp = find_fit(align_size)) != NULL) {
+        place(bp, align_size);
+        return bp;
+    }
+#endif
 
     // no fit found; extend heap memory
     size_t extend_size = MAX(align_size, CHUNK_SIZE);
@@ -140,17 +1023,38 @@ void *mm_malloc(size_t size) {
 }
 
 /**
- * Free the memory block pointed to by ptr; return nothing.
+ * Return the block pointed to by ptr to the shared heap, coalescing it with its neighbours.
  */
-void mm_free(void *ptr) {
-    if (ptr == NULL || heap_list == 0) {
+static void heap_free(void *ptr) {
+    if (ptr == NULL || arena->heap_list == 0) {
+        return;
+    }
+#if USE_SLAB
+    if (is_slab(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+#endif
+#if USE_MMAP
+    if (is_mapped(ptr)) {
+        map_free(ptr);
         return;
     }
+#endif
+#if USE_DEFER
     size_t size = BLOCK_SIZE(HEADER(ptr));
-    int prev_alloc = PREV_ALLOC(HEADER(ptr));
-    PUT(HEADER(ptr), PACK(size, prev_alloc));
-    PUT(FOOTER(ptr), PACK(size, prev_alloc));
-    coalesce(ptr);
+    if (size <= QUICK_MAX) {
+        int class = size / DOUBLE_SIZE;
+        QUICK_NEXT(ptr) = arena->quick_lists[class];
+        arena->quick_lists[class] = ptr;
+        arena->quick_total++;
+        if (++arena->quick_counts[class] > QUICK_COUNT) {
+            sweep();
+        }
+        return;
+    }
+#endif
+    free_block(ptr);
 }
 
 /**
@@ -160,112 +1064,364 @@ void mm_free(void *ptr) {
  * Otherwise, it changes the size of the memory block pointed to by ptr to size bytes
  * and returns the address of the new block.
  */
-void *mm_realloc(void *ptr, size_t size) {
+static void *heap_realloc(void *ptr, size_t size) {
     if (ptr == NULL) {
-        return mm_malloc(size);
+        return heap_malloc(size);
     }
     if (size == 0) {
-        mm_free(ptr);
+        heap_free(ptr);
         return NULL;
     }
 
-    size_t old_size = BLOCK_SIZE(HEADER(ptr));
-    size_t new_size;
-    if (size <= ALIGNMENT) {
-        new_size = 2 * ALIGNMENT;
-    } else {
-        new_size = ALIGN(size + WORD_SIZE);
+#if USE_SLAB
+    if (is_slab(ptr)) {
+        size_t obj_size = RUN_OF(ptr)->obj_size;
+        if (size <= obj_size) {
+            return ptr;
+        }
+        void *new_ptr = heap_malloc(size);
+        if (new_ptr == NULL)
+            return NULL;
+        memcpy(new_ptr, ptr, obj_size);
+        slab_free(ptr);
+        return new_ptr;
     }
+#endif
+#if USE_MMAP
+    if (is_mapped(ptr)) {
+        return map_realloc(ptr, size);
+    }
+#endif
+
+    size_t old_size = BLOCK_SIZE(HEADER(ptr));
+    size_t new_size = BLOCK_FOR(size);
 
     if (new_size <= old_size) {
-        if (old_size - new_size >= 2 * ALIGNMENT) {
+#if USE_HEADROOM
+        // keep the spare room of a growing block unless it shrinks a lot
+        if (GROWN(HEADER(ptr)) && new_size >= old_size / 2) {
+            return ptr;
+        }
+#endif
+        if (old_size - new_size >= MIN_BLOCK) {
             SET_PREV_FREE(HEADER(NEXT_BLOCK(ptr)));
             PUT(HEADER(ptr), PACK(new_size, ALLOC_BITS(HEADER(ptr))));
             PUT(HEADER(NEXT_BLOCK(ptr)), PACK(old_size - new_size, 2));
             PUT(FOOTER(NEXT_BLOCK(ptr)), PACK(old_size - new_size, 2));
             insert_node(NEXT_BLOCK(ptr), old_size - new_size);
+            arena->splits++;
         }
         return ptr;
     }
 
-    size_t extend_size = old_size;
     int prev_alloc = PREV_ALLOC(HEADER(ptr));
     int next_alloc = CURR_ALLOC(HEADER(NEXT_BLOCK(ptr)));
     void *prev_ptr = PREV_BLOCK(ptr);
     void *next_ptr = NEXT_BLOCK(ptr);
-    if (!next_alloc)
-        extend_size += BLOCK_SIZE(HEADER(next_ptr));
-    if (!prev_alloc)
-        extend_size += BLOCK_SIZE(HEADER(prev_ptr));
+    size_t prev_size = prev_alloc ? 0 : BLOCK_SIZE(HEADER(prev_ptr));
+    size_t next_size = next_alloc ? 0 : BLOCK_SIZE(HEADER(next_ptr));
+    size_t extend_size = old_size + next_size;
+
+    // a free predecessor costs a memmove; take it only if the successor is not enough
+    if (new_size > extend_size && new_size <= extend_size + prev_size) {
+        remove_node(prev_ptr);
+        memmove(prev_ptr, ptr, old_size - WORD_SIZE);
+        ptr = prev_ptr;
+        extend_size += prev_size;
+    }
 
     if (new_size <= extend_size) {
-        // coalesce with previous and next blocks
-        if (!prev_alloc && !next_alloc) {
-            remove_node(prev_ptr);
-            remove_node(next_ptr);
-            memmove(prev_ptr, ptr, old_size - WORD_SIZE);
-            ptr = prev_ptr;
-        } else if (!prev_alloc) {
-            // coalesce with the previous block only
-            remove_node(prev_ptr);
-            memmove(prev_ptr, ptr, old_size - WORD_SIZE);
-            ptr = prev_ptr;
-        } else if (!next_alloc) {
-            // coalesce with the next block only
+        if (!next_alloc) {
             remove_node(next_ptr);
         }
-        if (extend_size - new_size >= 2 * ALIGNMENT) {
+        if (extend_size - new_size >= MIN_BLOCK) {
             PUT(HEADER(ptr), PACK(new_size, PREV_ALLOC(HEADER(ptr)) + 1));
             next_ptr = NEXT_BLOCK(ptr);
             PUT(HEADER(next_ptr), PACK(extend_size - new_size, 2));
             PUT(FOOTER(next_ptr), PACK(extend_size - new_size, 2));
             insert_node(next_ptr, extend_size - new_size);
+            arena->splits++;
         } else {
             PUT(HEADER(ptr), PACK(extend_size, PREV_ALLOC(HEADER(ptr)) + 1));
             SET_PREV_ALLOC(HEADER(NEXT_BLOCK(ptr)));
         }
+#if USE_HEADROOM
+        SET_GROWN(HEADER(ptr));
+#endif
         return ptr;
     }
 
-    // try to extend the heap if at the end
-    if (BLOCK_SIZE(HEADER(NEXT_BLOCK(ptr))) == 0) {
-        size_t extend_bytes = ALIGN(new_size - old_size);
-        if ((long) (mem_sbrk(extend_bytes)) == -1)
+    // at the end of the heap, possibly behind a free block: grow with one sbrk
+    void *end_ptr = next_alloc ? next_ptr : NEXT_BLOCK(next_ptr);
+    if (BLOCK_SIZE(HEADER(end_ptr)) == 0) {
+        size_t extend_bytes = ALIGN(new_size - extend_size);
+        if ((long) (ARENA_SBRK(extend_bytes)) == -1)
             return NULL;
-        size_t total_size = old_size + extend_bytes;
+        if (!next_alloc) {
+            remove_node(next_ptr);
+        }
+        size_t total_size = extend_size + extend_bytes;
         PUT(HEADER(ptr), PACK(total_size, ALLOC_BITS(HEADER(ptr))));
-        PUT(FOOTER(ptr), PACK(total_size, ALLOC_BITS(HEADER(ptr))));
-        // Set new epilogue header
-        PUT(HEADER(NEXT_BLOCK(ptr)), PACK(0, 1));
+        // Set new epilogue header; the block before it is allocated
+        PUT(HEADER(NEXT_BLOCK(ptr)), PACK(0, 3));
+#if USE_HEADROOM
+        SET_GROWN(HEADER(ptr));
+#endif
         return ptr;
     }
 
     // Cannot expand in place, allocate new block
-    void *new_ptr = mm_malloc(size);
+    size_t copy_size = MIN(size, old_size - WORD_SIZE);
+#if USE_HEADROOM
+    if (GROWN(HEADER(ptr))) {
+        size = size / HEADROOM_DEN * HEADROOM_NUM;
+    }
+#endif
+    void *new_ptr = heap_malloc(size);
     if (new_ptr == NULL)
         return NULL;
-    memcpy(new_ptr, ptr, MIN(size, old_size - WORD_SIZE));
-    mm_free(ptr);
+#if USE_HEADROOM
+    if (has_header(size)) {
+        SET_GROWN(HEADER(new_ptr));
+    }
+#endif
+    memcpy(new_ptr, ptr, copy_size);
+    heap_free(ptr);
     return new_ptr;
 }
 
 
 /**
- * Extend the size of heap memory when initialized OR malloc is unable to find a fit.
- * @param bytes the number of bytes to grow; will be 8-byte aligned.
- * @return a pointer to the new free memory block; null pointer on error.
+ * Mark the heap block ptr free and coalesce it with its neighbours.
  */
-static void *extend_heap(size_t bytes) {
-    size_t size = ALIGN(bytes);
-    char *block_ptr = mem_sbrk(size);
-
-    // error handling
-    if ((size_t) block_ptr == -1) {
-        return NULL;
+static void free_block(void *ptr) {
+    size_t size = BLOCK_SIZE(HEADER(ptr));
+    int prev_alloc = PREV_ALLOC(HEADER(ptr));
+    PUT(HEADER(ptr), PACK(size, prev_alloc));
+    PUT(FOOTER(ptr), PACK(size, prev_alloc));
+    coalesce(ptr);
+#if USE_TRIM
+    if (++arena->trim_frees >= arena->trim_due) {
+        trim_sweep(0);
     }
+#endif
+}
 
-    // initialize free block header/footer
-    int prev_alloc = PREV_ALLOC(HEADER(block_ptr));
+#if USE_DEFER
+/**
+ * Free and coalesce every block on the current arena's quick lists.
+ * @return the number of blocks freed.
+ */
+static int sweep(void) {
+    int swept = arena->quick_total;
+    for (int class = 0; class < QUICK_CLASSES && arena->quick_total > 0; class++) {
+        void *bp = arena->quick_lists[class];
+        while (bp != NULL) {
+            void *next = QUICK_NEXT(bp);
+            free_block(bp);
+            bp = next;
+        }
+        arena->quick_total -= arena->quick_counts[class];
+        arena->quick_lists[class] = NULL;
+        arena->quick_counts[class] = 0;
+    }
+    return swept;
+}
+#endif
+
+/**
+ * Allocate an aligned block from the current arena's heap; the slack in front
+ * of the aligned payload goes back to the free lists.
+ */
+static void *heap_memalign(size_t alignment, size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    if (arena->heap_list == 0) {
+        heap_init();
+    }
+    return place_aligned(BLOCK_FOR(size), alignment);
+}
+
+/**
+ * Allocate n blocks of size bytes from the current arena's heap into out,
+ * carving each free block found into as many of them as it holds.
+ * @return the number of blocks allocated.
+ */
+static size_t heap_malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+    if (arena->heap_list == 0) {
+        heap_init();
+    }
+    size_t count = 0;
+#if USE_SLAB
+    // slab objects come a free-map word at a time instead
+    if (size <= SLAB_MAX && (count = slab_malloc_batch(size, n, out)) == n) {
+        return count;
+    }
+#endif
+#if USE_MMAP
+    if (size >= MMAP_THRESHOLD) {
+        for (; count < n && (out[count] = map_malloc(size)) != NULL; count++);
+        return count;
+    }
+#endif
+
+    size_t align_size = BLOCK_FOR(size);
+#if USE_DEFER
+    // reuse deferred blocks of exactly this size first
+    if (align_size <= QUICK_MAX) {
+        int class = align_size / DOUBLE_SIZE;
+        void *bp;
+        while (count < n && (bp = arena->quick_lists[class]) != NULL) {
+            arena->quick_lists[class] = QUICK_NEXT(bp);
+            arena->quick_counts[class]--;
+            arena->quick_total--;
+            out[count++] = bp;
+        }
+    }
+#endif
+
+    while (count < n) {
+        // prefer one free block that holds the whole rest of the batch,
+        // unless that is a single block and the search would just be repeated
+        size_t want = (n - count) * align_size;
+        void *bp = NULL;
+        if (want > align_size) {
+            bp = find_fit(want);
+        }
+        if (bp == NULL) {
+            bp = find_fit(align_size);
+        }
+#if USE_DEFER
+        if (bp == NULL && sweep() > 0) {
+            bp = find_fit(align_size);
+        }
+#endif
+        if (bp == NULL && (bp = extend_heap(MAX(want, CHUNK_SIZE))) == NULL
+            && (bp = extend_heap(MAX(align_size, CHUNK_SIZE))) == NULL) {
+            break;
+        }
+        count += place_batch(bp, align_size, n - count, out + count);
+    }
+    return count;
+}
+
+/**
+ * Free the n blocks in ptrs, sorted by address, into the current arena.
+ * Blocks that are neighbours in the heap are joined into one free block
+ * before it is coalesced and put on a free list.
+ */
+static void heap_free_batch(void **ptrs, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        char *bp = ptrs[i++];
+        if (bp == NULL) {
+            continue;
+        }
+#if USE_SLAB
+        if (is_slab(bp)) {
+            // the objects of one run are next to each other in ptrs
+            size_t j = i;
+            while (j < n && RUN_OF(ptrs[j]) == RUN_OF(bp) && is_slab(ptrs[j])) {
+                j++;
+            }
+            slab_free_batch(ptrs + i - 1, j - i + 1);
+            i = j;
+            continue;
+        }
+#endif
+#if USE_MMAP
+        if (is_mapped(bp)) {
+            map_free(bp);
+            continue;
+        }
+#endif
+        size_t size = BLOCK_SIZE(HEADER(bp));
+        while (i < n && (char *) ptrs[i] == bp + size
+#if USE_SLAB
+               && !is_slab(ptrs[i])
+#endif
+               ) {
+            size += BLOCK_SIZE(HEADER(ptrs[i++]));
+            arena->coalesces++;
+        }
+        PUT(HEADER(bp), PACK(size, ALLOC_BITS(HEADER(bp))));
+        free_block(bp);
+    }
+}
+
+#if USE_ZERO
+/**
+ * Allocate a zeroed block from the current arena's heap. A block that was
+ * already zero only needs its free-list links and footer cleared.
+ */
+static void *heap_calloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    if (arena->heap_list == 0) {
+        heap_init();
+    }
+#if USE_MMAP
+    if (size >= MMAP_THRESHOLD) {
+        return map_malloc(size);  // fresh mappings are zero
+    }
+#endif
+
+    size_t align_size = BLOCK_FOR(size);
+    char *bp = find_fit(align_size);
+#if USE_DEFER
+    if (bp == NULL && sweep() > 0) {
+        bp = find_fit(align_size);
+    }
+#endif
+    if (bp == NULL && (bp = extend_heap(MAX(align_size, CHUNK_SIZE))) == NULL) {
+        return NULL;
+    }
+
+    size_t free_size = BLOCK_SIZE(HEADER(bp));
+    int zeroed = ZEROED(HEADER(bp));
+    place(bp, align_size);
+    if (!zeroed) {
+        memset(bp, 0, size);
+        return bp;
+    }
+    memset(bp, 0, 2 * LINK_SIZE);
+    if (BLOCK_SIZE(HEADER(bp)) == free_size) {
+        PUT(bp + free_size - DOUBLE_SIZE, 0);  // the old footer is now payload
+    }
+    return bp;
+}
+#endif
+
+/**
+ * Extend the size of heap memory when initialized OR malloc is unable to find a fit.
+ * @param bytes the number of bytes to grow; will be 8-byte aligned.
+ * @return a pointer to the new free memory block; null pointer on error.
+ */
+static void *extend_heap(size_t bytes) {
+    size_t size = ALIGN(bytes);
+#if USE_ZERO
+    char *clean = mem_region_clean(arena->region);
+#endif
+    char *block_ptr = ARENA_SBRK(size);
+
+    // error handling
+    if ((size_t) block_ptr == -1) {
+        return NULL;
+    }
+
+    // initialize free block header/footer
+    int prev_alloc = PREV_ALLOC(HEADER(block_ptr));
+#if USE_ZERO
+    // memory that was never inside the break, or was given back, reads as zero
+    if (block_ptr >= clean) {
+        prev_alloc |= 0x4;
+    }
+#endif
     PUT(HEADER(block_ptr), PACK(size, prev_alloc));
     PUT(FOOTER(block_ptr), PACK(size, prev_alloc));
 
@@ -285,7 +1441,16 @@ static void *coalesce(void *bp) {
     int next_alloc = CURR_ALLOC(HEADER(NEXT_BLOCK(bp)));
     int prev_prev;
     size_t curr_size = BLOCK_SIZE(HEADER(bp));
+#if USE_ZERO
+    // the merged block stays zeroed only if every part of it was
+    void *curr_ptr = bp;
+    void *next_ptr = NEXT_BLOCK(bp);
+    int zeroed = ZEROED(HEADER(bp))
+                 && (prev_alloc || ZEROED(HEADER(PREV_BLOCK(bp))))
+                 && (next_alloc || ZEROED(HEADER(next_ptr)));
+#endif
 
+    arena->coalesces += !prev_alloc + !next_alloc;
     if (prev_alloc && next_alloc) {
         SET_PREV_FREE(HEADER(NEXT_BLOCK(bp)));
     } else if (prev_alloc && !next_alloc) {
@@ -311,35 +1476,198 @@ static void *coalesce(void *bp) {
         PUT(FOOTER(NEXT_BLOCK(bp)), PACK(curr_size, prev_prev));
         bp = PREV_BLOCK(bp);
     }
+#if USE_ZERO
+    if (zeroed && !(prev_alloc && next_alloc)) {
+        // the tags between the merged parts are now payload
+        if (!next_alloc) {
+            clear_tags(next_ptr);
+        }
+        if (!prev_alloc) {
+            clear_tags(curr_ptr);
+        }
+        SET_ZEROED(HEADER(bp));
+        SET_ZEROED(FOOTER(bp));
+    }
+#endif
     insert_node(bp, curr_size);
     return bp;
 }
 
+#if USE_ZERO
+// zero the header and links of a free block bp and the footer before it
+static inline void clear_tags(void *bp) {
+    PUT(BLOCK_PTR(bp) - DOUBLE_SIZE, 0);
+    PUT(HEADER(bp), 0);
+    memset(bp, 0, 2 * LINK_SIZE);
+}
+#endif
+
+#if USE_TRIM
+/**
+ * Return the memory of a large free block: shrink the heap if the block is the
+ * last one, otherwise release its pages but keep its boundary tags and links.
+ * @param bp a pointer to a free block.
+ * @return 1 if the block is still there, 0 if the heap was shrunk.
+ */
+static int release_block(void *bp) {
+    size_t size = BLOCK_SIZE(HEADER(bp));
+    if (BLOCK_SIZE(HEADER(NEXT_BLOCK(bp))) == 0) {
+        // mem_sbrk takes an int
+        size_t trim = MIN(size - CHUNK_SIZE, (size_t) INT_MAX) & ~(size_t) (CHUNK_SIZE - 1);
+        int prev_alloc = PREV_ALLOC(HEADER(bp));
+        remove_node(bp);
+        size -= trim;
+        PUT(HEADER(bp), PACK(size, prev_alloc));
+        PUT(FOOTER(bp), PACK(size, prev_alloc));
+        PUT(HEADER(NEXT_BLOCK(bp)), PACK(0, 1));  // epilogue after a free block
+        insert_node(bp, size);
+        ARENA_SBRK(-(int) trim);
+        return 0;
+    }
+    mem_release(BLOCK_PTR(bp) + 2 * LINK_SIZE, size - 2 * LINK_SIZE - DOUBLE_SIZE);
+    return 1;
+}
+
+/**
+ * Walk the current arena's heap and give back the large free blocks that have
+ * stayed free since the previous sweep, or all of them, then remember the ones
+ * seen now. The next sweep is due after at least as many frees as there are
+ * blocks.
+ */
+static void trim_sweep(int all) {
+    trim_slot seen[TRIM_SLOTS];
+    int n = 0, old = 0;
+    size_t blocks = 0;
+
+    for (char *bp = NEXT_BLOCK(arena->heap_list); BLOCK_SIZE(HEADER(bp)) != 0; bp = NEXT_BLOCK(bp)) {
+        size_t size = BLOCK_SIZE(HEADER(bp));
+        blocks++;
+        if (CURR_ALLOC(HEADER(bp)) || size < TRIM_THRESHOLD) {
+            continue;
+        }
+        // both sweeps see the blocks in address order
+        while (old < arena->trim_count && arena->trim_seen[old].bp < bp) {
+            old++;
+        }
+        int stayed = old < arena->trim_count && arena->trim_seen[old].bp == bp
+                     && arena->trim_seen[old].size == size;
+        // a released block may have been split and freed back since, so
+        // mm_trim releases every one
+        int released = stayed && arena->trim_seen[old].released;
+        if ((stayed && !released) || all) {
+            if (!release_block(bp)) {
+                break;
+            }
+            released = 1;
+        }
+        if (n < TRIM_SLOTS) {
+            seen[n].bp = bp;
+            seen[n].size = size;
+            seen[n].released = released;
+            n++;
+        }
+    }
+    memcpy(arena->trim_seen, seen, n * sizeof(trim_slot));
+    arena->trim_count = n;
+    arena->trim_frees = 0;
+    arena->trim_due = MAX(blocks, TRIM_INTERVAL);
+}
+#endif
+
+#if USE_HEADROOM
+// does heap_malloc(size) return an ordinary heap block, with a header of its own?
+static inline int has_header(size_t size) {
+#if USE_SLAB
+    if (size <= SLAB_MAX) {
+        return 0;
+    }
+#endif
+#if USE_MMAP
+    if (size >= MMAP_THRESHOLD) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+#endif
+
 static int find_group(size_t size) {
+#if USE_LIFO
+    if (size < EXACT_LIMIT) {
+        return (size - MIN_BLOCK) / DOUBLE_SIZE;
+    }
+    // log2(size) >= 8 here; split each power of two in half
+    int log = 31 - __builtin_clz(size);
+    int offset = EXACT_NUM + 2 * (log - 8) + ((size >> (log - 1)) & 1);
+#else
     int offset = 30 - __builtin_clz(size);
+#endif
     return (offset >= BUCKET_NUM) ? (BUCKET_NUM - 1) : offset;
 }
 
 static void *find_fit(size_t align_size) {
     void *bp;
+    arena->fit_calls++;
+#if USE_TREE
+    if (align_size >= TREE_MIN) {
+        arena->fit_steps++;
+        return tree_best_fit(align_size);
+    }
+#endif
     int n = find_group(align_size);
-    for (; n < BUCKET_NUM; n++) {
-        for (bp = free_lists[n]; bp != 0; bp = NEXT_NODE(bp)) {
-            if (align_size <= BLOCK_SIZE(HEADER(bp))) {
-                return bp;
-            }
+
+    // blocks in the request's own class may still be too small
+    unsigned long steps = 0;
+    for (bp = arena->free_lists[n]; bp != 0; bp = NEXT_NODE(bp)) {
+        steps++;
+        if (align_size <= BLOCK_SIZE(HEADER(bp))) {
+            arena->fit_steps += steps;
+            return bp;
         }
     }
-    return NULL;
+    arena->fit_steps += steps + 1;
+
+    // any block in a larger class fits; jump to the first non-empty one
+    uint64_t larger = arena->bucket_map & (~(uint64_t) 1 << n);
+    if (larger == 0) {
+#if USE_TREE
+        return tree_best_fit(align_size);
+#else
+        return NULL;
+#endif
+    }
+    return arena->free_lists[__builtin_ctzll(larger)];
+}
+
+// the largest block on a's free lists: the tree's rightmost node, else the best of the top list
+static size_t largest_free(arena_t *a) {
+    size_t largest = 0;
+#if USE_TREE
+    void *bp = a->tree_root;
+    if (bp != 0) {
+        while (RIGHT_NODE(bp) != 0) {
+            bp = RIGHT_NODE(bp);
+        }
+        return BLOCK_SIZE(HEADER(bp));
+    }
+#endif
+    if (a->bucket_map != 0) {
+        int n = 63 - __builtin_clzll(a->bucket_map);
+        for (void *bp = a->free_lists[n]; bp != 0; bp = NEXT_NODE(bp)) {
+            largest = MAX(largest, BLOCK_SIZE(HEADER(bp)));
+        }
+    }
+    return largest;
 }
 
 static void place(void *ptr, size_t align_size) {
     size_t free_size = BLOCK_SIZE(HEADER(ptr));
     size_t remainder = free_size - align_size;
+    int zeroed = ZEROED(HEADER(ptr));
     remove_node(ptr);
 
-    if (remainder < 2 * ALIGNMENT) {
-        SET_CURR_ALLOC(HEADER(ptr));
+    if (remainder < MIN_BLOCK) {
+        PUT(HEADER(ptr), PACK(free_size, PREV_ALLOC(HEADER(ptr)) + 1));
         SET_PREV_ALLOC(HEADER(NEXT_BLOCK(ptr)));
         if (CURR_ALLOC(HEADER(NEXT_BLOCK(ptr))) == 0) {
             SET_PREV_ALLOC(FOOTER(NEXT_BLOCK(ptr)));
@@ -347,16 +1675,107 @@ static void place(void *ptr, size_t align_size) {
     } else {
         PUT(HEADER(ptr), PACK(align_size, PREV_ALLOC(HEADER(ptr)) + 1));
         ptr = NEXT_BLOCK(ptr);
-        PUT(HEADER(ptr), PACK(remainder, 2));
-        PUT(FOOTER(ptr), PACK(remainder, 2));
+        PUT(HEADER(ptr), PACK(remainder, 2 | zeroed));
+        PUT(FOOTER(ptr), PACK(remainder, 2 | zeroed));
         insert_node(ptr, remainder);
+        arena->splits++;
+    }
+}
+
+/**
+ * Carve up to n allocated blocks of align_size bytes from the free block ptr,
+ * storing them in out; a remainder too small to stay free goes to the last one.
+ * @return the number of blocks carved.
+ */
+static size_t place_batch(void *ptr, size_t align_size, size_t n, void **out) {
+    size_t free_size = BLOCK_SIZE(HEADER(ptr));
+    size_t count = MIN(n, free_size / align_size);
+    size_t remainder = free_size - count * align_size;
+    int zeroed = ZEROED(HEADER(ptr));
+    int prev_alloc = PREV_ALLOC(HEADER(ptr));
+    char *bp = ptr;
+    remove_node(ptr);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t size = align_size;
+        if (i == count - 1 && remainder < MIN_BLOCK) {
+            size += remainder;
+            remainder = 0;
+        }
+        PUT(HEADER(bp), PACK(size, prev_alloc | 1));
+        prev_alloc = 2;
+        out[i] = bp;
+        bp += size;
+    }
+    if (remainder > 0) {
+        PUT(HEADER(bp), PACK(remainder, 2 | zeroed));
+        PUT(FOOTER(bp), PACK(remainder, 2 | zeroed));
+        insert_node(bp, remainder);
+        arena->splits++;
+    } else {
+        SET_PREV_ALLOC(HEADER(bp));
+    }
+    return count;
+}
+
+/**
+ * Allocate a block whose payload address is a multiple of alignment (a power of two).
+ * Any leading slack is split off and returned to the free lists.
+ */
+static void *place_aligned(size_t align_size, size_t alignment) {
+    // the lead can take up to MIN_BLOCK plus one alignment step
+    size_t search_size = align_size + MAX(alignment, MIN_BLOCK) + MIN_BLOCK;
+    char *bp = find_fit(search_size);
+    if (bp == NULL && (bp = extend_heap(MAX(search_size, CHUNK_SIZE))) == NULL) {
+        return NULL;
+    }
+
+    char *ap = (char *) (((size_t) bp + alignment - 1) & ~(alignment - 1));
+    // the slack in front must hold a free block; alignments below MIN_BLOCK
+    // may need several steps to get there
+    while (ap != bp && ap - bp < MIN_BLOCK) {
+        ap += alignment;
     }
+    if (ap != bp) {
+        size_t size = BLOCK_SIZE(HEADER(bp));
+        size_t lead = ap - bp;
+        int prev_alloc = PREV_ALLOC(HEADER(bp));
+        int zeroed = ZEROED(HEADER(bp));
+        remove_node(bp);
+        PUT(HEADER(bp), PACK(lead, prev_alloc | zeroed));
+        PUT(FOOTER(bp), PACK(lead, prev_alloc | zeroed));
+        insert_node(bp, lead);
+        arena->splits++;
+        PUT(HEADER(ap), PACK(size - lead, zeroed));
+        PUT(FOOTER(ap), PACK(size - lead, zeroed));
+        insert_node(ap, size - lead);
+    }
+    place(ap, align_size);
+    return ap;
 }
 
 static inline void insert_node(void *bp, size_t size) {
+#if USE_TREE
+    if (size >= TREE_MIN) {
+        arena->free_bytes[TREE_CLASS] += size;
+        tree_insert(bp);
+        return;
+    }
+#endif
     int n = find_group(size);
+    arena->free_bytes[n] += size;
+#if USE_LIFO
+    void *head = arena->free_lists[n];
+    SET_PREV_NODE(bp, 0);
+    SET_NEXT_NODE(bp, head);
+    if (head) {
+        SET_PREV_NODE(head, bp);
+    }
+    arena->free_lists[n] = bp;
+    arena->bucket_map |= (uint64_t) 1 << n;
+#else
     void *prev = 0;
-    void *current = free_lists[n];
+    void *current = arena->free_lists[n];
 
     while (current != 0 && current < bp) {
         prev = current;
@@ -366,22 +1785,35 @@ static inline void insert_node(void *bp, size_t size) {
     SET_NEXT_NODE(bp, current);
 
     if (prev == 0) {
-        free_lists[n] = bp;
+        arena->free_lists[n] = bp;
+        arena->bucket_map |= (uint64_t) 1 << n;
     } else {
         SET_NEXT_NODE(prev, bp);
     }
     if (current) {
         SET_PREV_NODE(current, bp);
     }
+#endif
 }
 
 static inline void remove_node(void *bp) {
+    size_t size = BLOCK_SIZE(HEADER(bp));
+#if USE_TREE
+    if (size >= TREE_MIN) {
+        arena->free_bytes[TREE_CLASS] -= size;
+        tree_remove(bp);
+        return;
+    }
+#endif
     void *prev = PREV_NODE(bp);
     void *next = NEXT_NODE(bp);
-    size_t size = BLOCK_SIZE(HEADER(bp));
     int num = find_group(size);
+    arena->free_bytes[num] -= size;
     if (prev == 0) {
-        free_lists[num] = next;
+        arena->free_lists[num] = next;
+        if (next == 0) {
+            arena->bucket_map &= ~((uint64_t) 1 << num);
+        }
     } else {
         SET_NEXT_NODE(prev, next);
     }
@@ -391,8 +1823,445 @@ static inline void remove_node(void *bp) {
 }
 
 
+#if USE_TREE
+// order tree nodes by (size, address); returns <0, 0 or >0 like strcmp
+static inline int tree_cmp(size_t size, void *bp, void *node) {
+    size_t node_size = BLOCK_SIZE(HEADER(node));
+    if (size != node_size) {
+        return (size < node_size) ? -1 : 1;
+    }
+    return (bp < node) ? -1 : (bp > node);
+}
+
+/**
+ * Top-down splay: bring the node with key (size, bp), or the last node on its
+ * search path, to the root of the tree.
+ * @return the new root.
+ */
+static void *splay(void *root, size_t size, void *bp) {
+    size_t header[2] = {0, 0};   // stands in for a node holding both side trees
+    void *left = header, *right = header;
+    void *next;
+
+    if (root == 0) {
+        return 0;
+    }
+    for (;;) {
+        int cmp = tree_cmp(size, bp, root);
+        if (cmp < 0) {
+            if ((next = LEFT_NODE(root)) == 0)
+                break;
+            if (tree_cmp(size, bp, next) < 0) {
+                // rotate right
+                SET_LEFT_NODE(root, RIGHT_NODE(next));
+                SET_RIGHT_NODE(next, root);
+                root = next;
+                if ((next = LEFT_NODE(root)) == 0)
+                    break;
+            }
+            // link right
+            SET_LEFT_NODE(right, root);
+            right = root;
+            root = next;
+        } else if (cmp > 0) {
+            if ((next = RIGHT_NODE(root)) == 0)
+                break;
+            if (tree_cmp(size, bp, next) > 0) {
+                // rotate left
+                SET_RIGHT_NODE(root, LEFT_NODE(next));
+                SET_LEFT_NODE(next, root);
+                root = next;
+                if ((next = RIGHT_NODE(root)) == 0)
+                    break;
+            }
+            // link left
+            SET_RIGHT_NODE(left, root);
+            left = root;
+            root = next;
+        } else {
+            break;
+        }
+    }
+    // assemble
+    SET_RIGHT_NODE(left, LEFT_NODE(root));
+    SET_LEFT_NODE(right, RIGHT_NODE(root));
+    SET_LEFT_NODE(root, RIGHT_NODE(header));
+    SET_RIGHT_NODE(root, LEFT_NODE(header));
+    return root;
+}
+
+static void tree_insert(void *bp) {
+    size_t size = BLOCK_SIZE(HEADER(bp));
+    if (arena->tree_root == 0) {
+        SET_LEFT_NODE(bp, 0);
+        SET_RIGHT_NODE(bp, 0);
+    } else {
+        arena->tree_root = splay(arena->tree_root, size, bp);
+        if (tree_cmp(size, bp, arena->tree_root) < 0) {
+            SET_LEFT_NODE(bp, LEFT_NODE(arena->tree_root));
+            SET_RIGHT_NODE(bp, arena->tree_root);
+            SET_LEFT_NODE(arena->tree_root, 0);
+        } else {
+            SET_RIGHT_NODE(bp, RIGHT_NODE(arena->tree_root));
+            SET_LEFT_NODE(bp, arena->tree_root);
+            SET_RIGHT_NODE(arena->tree_root, 0);
+        }
+    }
+    arena->tree_root = bp;
+}
+
+static void tree_remove(void *bp) {
+    size_t size = BLOCK_SIZE(HEADER(bp));
+    void *root = splay(arena->tree_root, size, bp);
+    if (LEFT_NODE(root) == 0) {
+        arena->tree_root = RIGHT_NODE(root);
+    } else {
+        // bp is larger than everything on its left, so the maximum comes up
+        arena->tree_root = splay(LEFT_NODE(root), size, bp);
+        SET_RIGHT_NODE(arena->tree_root, RIGHT_NODE(root));
+    }
+}
+
+// the in-order successor of bp, which must be the root; null pointer if none
+static inline void *tree_successor(void *bp) {
+    if ((bp = RIGHT_NODE(bp)) == 0) {
+        return 0;
+    }
+    while (LEFT_NODE(bp) != 0) {
+        bp = LEFT_NODE(bp);
+    }
+    return bp;
+}
+
+/**
+ * Find the smallest free block of at least align_size bytes, lowest address first.
+ * @return the block, or null pointer if no large block fits.
+ */
+static void *tree_best_fit(size_t align_size) {
+    if (arena->tree_root == 0) {
+        return NULL;
+    }
+    arena->tree_root = splay(arena->tree_root, align_size, 0);
+    void *bp = arena->tree_root;
+    if (BLOCK_SIZE(HEADER(bp)) < align_size && (bp = tree_successor(bp)) == 0) {
+        return NULL;
+    }
+
+    // keep the block at the end of the heap free for in-place growth if possible
+    if (BLOCK_SIZE(HEADER(NEXT_BLOCK(bp))) == 0) {
+        arena->tree_root = splay(arena->tree_root, BLOCK_SIZE(HEADER(bp)), bp);
+        void *next = tree_successor(bp);
+        if (next != 0) {
+            return next;
+        }
+    }
+    return bp;
+}
+#endif
+
+#if USE_SLAB
+static inline int is_slab(void *ptr) {
+    size_t page = PAGE_INDEX(ptr);
+    return page < SLAB_MAP_PAGES && slab_pages[page];
+}
+
+/**
+ * Carve a new page-aligned run for objects of the given class out of the heap.
+ * @return the run, or null pointer if the heap is full or the run lies outside slab_pages.
+ */
+static slab_run *new_run(int class) {
+    slab_run *run = place_aligned(ALIGN(RUN_SIZE + WORD_SIZE), RUN_SIZE);
+    if (run == NULL) {
+        return NULL;
+    }
+    size_t page = PAGE_INDEX(run);
+    if (page >= SLAB_MAP_PAGES) {
+        heap_free(run);
+        return NULL;
+    }
+    slab_pages[page] = 1;
+
+    run->obj_size = (class + 1) * DOUBLE_SIZE;
+    run->slot_num = (RUN_SIZE - sizeof(slab_run)) / run->obj_size;
+    run->free_num = run->slot_num;
+    for (int i = 0; i < RUN_MAP_WORDS; i++) {
+        int bits = run->slot_num - i * 64;
+        run->free_map[i] = (bits >= 64) ? ~(uint64_t) 0 : (bits > 0) ? ((uint64_t) 1 << bits) - 1 : 0;
+    }
+    run->prev = 0;
+    run->next = 0;
+    arena->slab_lists[class] = run;
+    return run;
+}
+
+static void *slab_malloc(size_t size) {
+    int class = SLAB_CLASS(size);
+    slab_run *run = arena->slab_lists[class];
+    if (run == NULL && (run = new_run(class)) == NULL) {
+        return NULL;
+    }
+
+    int word = 0;
+    while (run->free_map[word] == 0) {
+        word++;
+    }
+    int bit = __builtin_ctzll(run->free_map[word]);
+    run->free_map[word] &= ~((uint64_t) 1 << bit);
+
+    // a full run leaves its class list until a slot is freed
+    if (--run->free_num == 0) {
+        arena->slab_lists[class] = run->next;
+        if (run->next) {
+            run->next->prev = 0;
+        }
+    }
+    return RUN_SLOT(run, word * 64 + bit);
+}
+
+static void slab_free(void *ptr) {
+    slab_free_batch(&ptr, 1);
+}
+
+// take up to n objects of the given size from the class's runs, a free-map word at a time
+static size_t slab_malloc_batch(size_t size, size_t n, void **out) {
+    int class = SLAB_CLASS(size);
+    size_t count = 0;
+    while (count < n) {
+        slab_run *run = arena->slab_lists[class];
+        if (run == NULL && (run = new_run(class)) == NULL) {
+            break;
+        }
+        for (int word = 0; word < RUN_MAP_WORDS && count < n; word++) {
+            uint64_t bits = run->free_map[word];
+            for (; bits != 0 && count < n; bits &= bits - 1) {
+                out[count++] = RUN_SLOT(run, word * 64 + __builtin_ctzll(bits));
+                run->free_num--;
+            }
+            run->free_map[word] = bits;
+        }
+        // a full run leaves its class list until a slot is freed
+        if (run->free_num == 0) {
+            arena->slab_lists[class] = run->next;
+            if (run->next) {
+                run->next->prev = 0;
+            }
+        }
+    }
+    return count;
+}
+
+// free n objects that all lie in the same run
+static void slab_free_batch(void **ptrs, size_t n) {
+    slab_run *run = RUN_OF(ptrs[0]);
+    int class = SLAB_CLASS(run->obj_size);
+    for (size_t i = 0; i < n; i++) {
+        size_t slot = ((char *) ptrs[i] - RUN_SLOT(run, 0)) / run->obj_size;
+        run->free_map[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    }
+
+    if (run->free_num == 0) {
+        run->prev = 0;
+        run->next = arena->slab_lists[class];
+        if (run->next) {
+            run->next->prev = run;
+        }
+        arena->slab_lists[class] = run;
+    }
+    run->free_num += n;
+
+    // give an empty run back to the heap, unless it is the only one left in its class
+    if (run->free_num == run->slot_num && (run->prev || run->next)) {
+        if (run->prev) {
+            run->prev->next = run->next;
+        } else {
+            arena->slab_lists[class] = run->next;
+        }
+        if (run->next) {
+            run->next->prev = run->prev;
+        }
+        size_t page = PAGE_INDEX(run);
+        slab_pages[page] = 0;
+        heap_free(run);
+    }
+}
+#endif
+
+#if USE_MMAP
+// the slab check comes first: the word before a slab object is another object's data
+static inline int is_mapped(void *ptr) {
+#if USE_SLAB
+    if (is_slab(ptr)) {
+        return 0;
+    }
+#endif
+    return GET(HEADER(ptr)) == PACK(0, 1);
+}
+
+/**
+ * Give a huge request a mapping of its own.
+ * @return the payload, or null pointer if mem_map failed.
+ */
+static void *map_malloc(size_t size) {
+    size_t length = (size + ALIGNMENT + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    char *base = mem_map(length);
+    if (base == NULL) {
+        return NULL;
+    }
+    char *bp = base + ALIGNMENT;
+    MAP_LENGTH(bp) = length;
+    PUT(HEADER(bp), PACK(0, 1));
+    return bp;
+}
+
+static void map_free(void *ptr) {
+    mem_unmap(BLOCK_PTR(ptr) - ALIGNMENT);
+}
+
+/**
+ * Resize a huge block by remapping it; a block that shrinks below
+ * MMAP_THRESHOLD moves back into the heap.
+ */
+static void *map_realloc(void *ptr, size_t size) {
+    if (size < MMAP_THRESHOLD) {
+        void *new_ptr = mm_malloc(size);
+        if (new_ptr == NULL)
+            return NULL;
+        memcpy(new_ptr, ptr, size);
+        map_free(ptr);
+        return new_ptr;
+    }
+
+    size_t length = (size + ALIGNMENT + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if (length == MAP_LENGTH(ptr)) {
+        return ptr;
+    }
+    char *base = mem_remap(BLOCK_PTR(ptr) - ALIGNMENT, length);
+    if (base == NULL) {
+        return NULL;
+    }
+    MAP_LENGTH(base + ALIGNMENT) = length;
+    return base + ALIGNMENT;
+}
+#endif
+
+#if USE_THREADS
+// thread exit destructor: hand the cached blocks back to the heap
+static void cache_release(void *arg) {
+    thread_cache *tc = arg;
+    if (tc->epoch != heap_epoch) {
+        return;
+    }
+    for (int class = 0; class < CACHE_CLASSES; class++) {
+        if (tc->counts[class] > 0) {
+            cache_flush(tc, class, tc->counts[class]);
+        }
+    }
+}
+
+static void cache_create_key(void) {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+/**
+ * Return the calling thread's cache, emptied if mm_init has reset the heap since its last use.
+ */
+static thread_cache *get_cache(void) {
+    thread_cache *tc = &cache;
+    if (!tc->registered) {
+        pthread_once(&cache_once, cache_create_key);
+        pthread_setspecific(cache_key, tc);
+        tc->registered = 1;
+    }
+    if (tc->epoch != heap_epoch) {
+        memset(tc->lists, 0, sizeof(tc->lists));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        tc->epoch = heap_epoch;
+    }
+    return tc;
+}
+
+// move up to CACHE_BATCH new blocks of the given class from the heap into the cache
+static void cache_refill(thread_cache *tc, int class) {
+    arena_t *a = home_arena();
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+    void *blocks[CACHE_BATCH];
+    size_t count = heap_malloc_batch(class * DOUBLE_SIZE, CACHE_BATCH, blocks);
+    pthread_mutex_unlock(&a->lock);
+    for (size_t i = 0; i < count; i++) {
+        CACHE_NEXT(blocks[i]) = tc->lists[class];
+        tc->lists[class] = blocks[i];
+        tc->counts[class]++;
+    }
+}
+
+// return count blocks of the given class from the cache to the arenas that own them
+static void cache_flush(thread_cache *tc, int class, int count) {
+    arena_t *locked = 0;
+    for (int i = 0; i < count; i++) {
+        void *bp = tc->lists[class];
+        tc->lists[class] = CACHE_NEXT(bp);
+        tc->counts[class]--;
+
+        arena_t *owner = owner_arena(bp);
+        if (owner != locked) {
+            if (locked) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&owner->lock);
+            locked = arena = owner;
+        }
+        heap_free(bp);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+// the arena the calling thread allocates from, picked on first use
+static arena_t *home_arena(void) {
+    if (home == 0) {
+#if ARENA_BY_CPU
+        int cpu = sched_getcpu();
+        home = &arenas[(cpu < 0 ? 0 : cpu) % ARENA_NUM];
+#else
+        home = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % ARENA_NUM];
+#endif
+    }
+    return home;
+}
+
+// the arena whose region holds ptr
+static inline arena_t *owner_arena(void *ptr) {
+#if ARENA_NUM > 1
+    return &arenas[mem_region_of(ptr)];
+#else
+    return &arenas[0];
+#endif
+}
+
+/**
+ * Allocate from the calling thread's arena, falling back to the others when its region is full.
+ */
+static void *arena_malloc(size_t size) {
+    arena_t *first = home_arena();
+    for (int i = 0; i < ARENA_NUM; i++) {
+        arena_t *a = &arenas[(first - arenas + i) % ARENA_NUM];
+        pthread_mutex_lock(&a->lock);
+        arena = a;
+        void *bp = heap_malloc(size);
+        pthread_mutex_unlock(&a->lock);
+        if (bp != NULL) {
+            return bp;
+        }
+    }
+    return NULL;
+}
+#endif
+
 static void check_heap() {
-    void *bp = mem_heap_lo() + BUCKET_NUM * DOUBLE_SIZE;
+    void *bp = arena->heap_list - DOUBLE_SIZE;
+    void *heap_hi = mem_region_hi(arena->region);
 
     // prologue
     if (GET(bp) != 0) {
@@ -409,7 +2278,7 @@ static void check_heap() {
     // heap
     int prev_alloc = 1;
     int prev_free = 0;
-    while (bp < mem_heap_hi()) {
+    while (bp < heap_hi) {
         if (BLOCK_SIZE(HEADER(bp)) == 0) {
             printf("invalid block size at %p\n", bp);
         }
@@ -444,7 +2313,7 @@ static void check_heap() {
     if (PREV_ALLOC(HEADER(bp)) != prev_alloc) {
         printf("epilogue prev alloc bit error at %p\n", bp);
     }
-    if (bp > mem_heap_hi()) {
+    if (bp > heap_hi) {
         printf("block exceeds heap break at %p\n", bp);
     }
 }
@@ -453,7 +2322,7 @@ static void check_freelist() {
     void *bp;
     for (int i = 0; i < BUCKET_NUM; i++) {
         printf("Group %d: ", i);
-        for (bp = free_lists[i]; bp; bp = NEXT_NODE(bp)) {
+        for (bp = arena->free_lists[i]; bp; bp = NEXT_NODE(bp)) {
             printf("%d, ", BLOCK_SIZE(HEADER(bp)));
         }
         printf("\n");
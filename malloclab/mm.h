@@ -3,7 +3,40 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern void mm_trim(void);
+
+/* Set if mm.c was built with USE_THREADS=1 */
+extern const int mm_thread_safe;
+
+/* Heap telemetry, filled in by mm_stats */
+#define MM_STAT_CLASSES 65
+
+struct mm_stats {
+    size_t heap_bytes;       /* bytes of heap and huge-block mappings */
+    size_t used_bytes;       /* of those, bytes not in a free block */
+    size_t free_bytes;       /* bytes in free blocks */
+    size_t largest_free;     /* size of the largest free block */
+    double fragmentation;    /* 1 - largest_free / free_bytes */
+    int classes;             /* entries of class_free in use */
+    size_t class_free[MM_STAT_CLASSES]; /* free bytes per free list; the last
+                                           entry in use is the large-block tree */
+    unsigned long splits;    /* free blocks split to serve a request */
+    unsigned long coalesces; /* free blocks merged into a neighbour */
+    unsigned long fit_calls; /* free-list searches */
+    double avg_search;       /* free blocks looked at per search */
+};
+
+extern void mm_stats(struct mm_stats *st);
+
+/* Heap layout, one "offset bytes a|f" line per run of blocks */
+extern void mm_snapshot(FILE *fp, long label);
 
 
 /* 
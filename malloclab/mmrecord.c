@@ -0,0 +1,564 @@
+/*
+ * mmrecord.c - an LD_PRELOAD shim that records the malloc, calloc,
+ *              realloc, memalign and free calls of a running program
+ *              as an mdriver trace.
+ *
+ *              unix> LD_PRELOAD=./mmrecord.so MMRECORD=proxy.rep ./proxy
+ *
+ *              Every thread appends its calls to a ring buffer of its
+ *              own, which the recorder's writer thread empties, so
+ *              recording takes no lock; a thread that fills its ring
+ *              empties it itself rather than wait. A thread's ring
+ *              is handed to the next new thread once it exits, so a
+ *              program that starts a thread per request needs only as
+ *              many rings as it runs threads at once. A global
+ *              sequence number puts the calls of all threads in one
+ *              order. The writer thread drains the rings to a raw file
+ *              next to the trace; at exit the raw calls are sorted into
+ *              that order and each block gets a compact id, from 0 up in
+ *              the order the blocks were allocated.
+ *
+ *              MMRECORD names the trace, "%p" in it standing for the
+ *              process id; the default is mmrecord.%p.rep. Children
+ *              forked by the program are not recorded. Nothing is
+ *              written if the program ends with _exit or a signal.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RING_SIZE  4096         /* calls a thread's ring holds; a power of 2 */
+#define BOOT_SIZE  (64*1024)    /* bytes handed out while dlsym runs */
+#define HDR_WIDTH  12           /* width the trace header's numbers are padded to */
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* What a recorded call did, as the trace will say it */
+enum {EV_ALLOC, EV_FREE, EV_REALLOC, EV_MEMALIGN};
+
+/* One recorded call */
+typedef struct {
+    uint64_t seq;       /* place of the call in the order of all threads */
+    uint64_t ptr;       /* block returned, or freed */
+    uint64_t old;       /* block a realloc was given; the block's id at exit */
+    uint32_t size;      /* bytes asked for */
+    uint32_t align;     /* alignment of a memalign */
+    int32_t type;       /* EV_ALLOC ... EV_MEMALIGN */
+    int32_t pad;
+} event_t;
+
+/* A thread's calls, waiting for the writer thread */
+typedef struct ring {
+    struct ring *next;                   /* next on the list of all rings */
+    volatile unsigned long head;         /* next call the writer takes */
+    volatile unsigned long tail;         /* next slot the thread fills */
+    volatile int busy;                   /* set while someone empties the ring */
+    volatile int owned;                  /* set while a thread records into it */
+    event_t ev[RING_SIZE];
+} ring_t;
+
+/* The allocator underneath */
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+/* Memory for dlsym's own calls, before the allocator is known */
+static char boot[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+static int resolving;
+
+/* Recorder state */
+static volatile int recording;       /* set while calls are being recorded */
+static volatile int stopping;        /* tells the writer thread to finish */
+static ring_t *volatile rings;       /* every thread's ring */
+static uint64_t seq;                 /* next sequence number */
+static unsigned long stalls;         /* times a thread found its ring full */
+static int raw_fd = -1;              /* where the writer thread puts calls */
+static pthread_t writer;
+static pthread_key_t ring_key;       /* gives a ring back when its thread exits */
+static char trace_path[4096];
+static char raw_path[4096 + 8];
+
+static TLS ring_t *my_ring;          /* this thread's ring */
+static TLS int in_recorder;          /* set while this thread is inside us */
+
+static void resolve(void);
+static void record(int type, void *ptr, void *old, size_t size, size_t align);
+static ring_t *claim_ring(void);
+static void release_ring(void *arg);
+static void *write_rings(void *arg);
+static int drain(ring_t *r);
+static void stop_in_child(void);
+static void write_trace(void);
+
+/*
+ * mmrecord_init - find the real allocator, open the raw file and start
+ *     the writer thread when the program is loaded
+ */
+__attribute__((constructor))
+static void mmrecord_init(void)
+{
+    char *name = getenv("MMRECORD"), *p;
+    char pid[32];
+    size_t len;
+
+    in_recorder = 1;
+    resolve();
+    if (name == NULL || *name == '\0')
+        name = "mmrecord.%p.rep";
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if ((p = strstr(name, "%p")) != NULL) {
+        len = p - name;
+        snprintf(trace_path, sizeof(trace_path), "%.*s%s%s", (int)len, name, pid, p + 2);
+    }
+    else
+        snprintf(trace_path, sizeof(trace_path), "%s", name);
+    snprintf(raw_path, sizeof(raw_path), "%s.raw", trace_path);
+
+    if ((raw_fd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "mmrecord: %s: %s\n", raw_path, strerror(errno));
+        in_recorder = 0;
+        return;
+    }
+    pthread_atfork(NULL, NULL, stop_in_child);
+    if (pthread_key_create(&ring_key, release_ring) != 0 ||
+        pthread_create(&writer, NULL, write_rings, NULL) != 0) {
+        close(raw_fd);
+        unlink(raw_path);
+        in_recorder = 0;
+        return;
+    }
+    recording = 1;
+    in_recorder = 0;
+}
+
+/*
+ * mmrecord_fini - stop recording, drain every ring and turn the raw
+ *     file into the trace when the program exits
+ */
+__attribute__((destructor))
+static void mmrecord_fini(void)
+{
+    ring_t *r;
+
+    if (!recording)
+        return;
+    in_recorder = 1;
+    recording = 0;
+    stopping = 1;
+    pthread_join(writer, NULL);
+    for (r = rings; r != NULL; r = r->next)
+        drain(r);
+    write_trace();
+    close(raw_fd);
+    unlink(raw_path);
+}
+
+/*
+ * The hooks. A call is recorded after the real allocator returns a
+ * block, but before it gets a block back, so that no thread can be
+ * handed a block in the order before it was freed.
+ */
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (real_malloc == NULL)
+        resolve();
+    if (resolving) {
+        size = (size + 15) & ~(size_t)15;
+        if (boot_used + size > BOOT_SIZE)
+            return NULL;
+        p = boot + boot_used;
+        boot_used += size;
+        return p;
+    }
+    if ((p = real_malloc(size)) != NULL)
+        record(EV_ALLOC, p, NULL, size, 0);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || ((char *)ptr >= boot && (char *)ptr < boot + BOOT_SIZE))
+        return;
+    record(EV_FREE, ptr, NULL, 0, 0);
+    real_free(ptr);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p;
+
+    if (real_calloc == NULL)
+        resolve();
+    if (resolving)
+        return malloc(n * size); /* boot is all zeros */
+    if ((p = real_calloc(n, size)) != NULL)
+        record(EV_ALLOC, p, NULL, n * size, 0);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    size_t n;
+
+    if (real_realloc == NULL)
+        resolve();
+    if ((char *)ptr >= boot && (char *)ptr < boot + BOOT_SIZE) {
+        n = boot + BOOT_SIZE - (char *)ptr; /* the old size isn't known */
+        if ((p = malloc(size)) != NULL)
+            memcpy(p, ptr, size < n ? size : n);
+        return p;
+    }
+    if (ptr != NULL && size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if ((p = real_realloc(ptr, size)) != NULL)
+        record(ptr ? EV_REALLOC : EV_ALLOC, p, ptr, size, 0);
+    return p;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (real_memalign == NULL)
+        resolve();
+    if ((p = real_memalign(align, size)) != NULL)
+        record(EV_MEMALIGN, p, NULL, size, align);
+    return p;
+}
+
+int posix_memalign(void **pp, size_t align, size_t size)
+{
+    int err;
+
+    if (real_posix_memalign == NULL)
+        resolve();
+    if ((err = real_posix_memalign(pp, align, size)) == 0)
+        record(EV_MEMALIGN, *pp, NULL, size, align);
+    return err;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    void *p;
+
+    if (real_aligned_alloc == NULL)
+        resolve();
+    if ((p = real_aligned_alloc(align, size)) != NULL)
+        record(EV_MEMALIGN, p, NULL, size, align);
+    return p;
+}
+
+/*
+ * resolve - look up the allocator the program would have used. dlsym
+ *     may allocate, which malloc serves out of boot meanwhile.
+ */
+static void resolve(void)
+{
+    if (real_malloc != NULL || resolving)
+        return;
+    resolving = 1;
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    resolving = 0;
+}
+
+/*
+ * record - append a call to this thread's ring, claiming a ring for
+ *     the thread on its first call. A full ring waits for the writer.
+ */
+static void record(int type, void *ptr, void *old, size_t size, size_t align)
+{
+    ring_t *r = my_ring;
+    event_t *e;
+
+    if (!recording || in_recorder)
+        return;
+    if (r == NULL && (r = claim_ring()) == NULL)
+        return;
+
+    if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        __sync_fetch_and_add(&stalls, 1);
+        while (drain(r) == 0 &&
+               r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+            sched_yield();
+    }
+    e = &r->ev[r->tail & (RING_SIZE - 1)];
+    e->seq = __sync_fetch_and_add(&seq, 1);
+    e->type = type;
+    e->ptr = (uintptr_t)ptr;
+    e->old = (uintptr_t)old;
+    e->size = size > UINT32_MAX ? UINT32_MAX : size;
+    e->align = align;
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * claim_ring - take a ring an exited thread gave back, or map a new one
+ *     and put it on the list of all rings. A ring is never taken off
+ *     the list: calls an exited thread left in it are still waiting for
+ *     the writer, and its new owner appends after them.
+ */
+static ring_t *claim_ring(void)
+{
+    ring_t *r;
+
+    for (r = rings; r != NULL; r = r->next)
+        if (!r->owned && __sync_bool_compare_and_swap(&r->owned, 0, 1))
+            break;
+    if (r == NULL) {
+        r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED)
+            return NULL;
+        r->owned = 1;
+        do {
+            r->next = rings;
+        } while (!__sync_bool_compare_and_swap(&rings, r->next, r));
+    }
+    my_ring = r;
+    in_recorder = 1;
+    pthread_setspecific(ring_key, r);
+    in_recorder = 0;
+    return r;
+}
+
+/*
+ * release_ring - the thread's exit: give its ring back. A call the
+ *     thread makes after this (from a later destructor) claims one anew.
+ */
+static void release_ring(void *arg)
+{
+    ring_t *r = arg;
+
+    my_ring = NULL;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * write_rings - the writer thread: move calls from the rings to the
+ *     raw file until told to stop, napping whenever they are all empty
+ */
+static void *write_rings(void *arg)
+{
+    struct timespec nap = {0, 1000000};
+    ring_t *r;
+    int moved;
+
+    in_recorder = 1;
+    while (!stopping) {
+        moved = 0;
+        for (r = rings; r != NULL; r = r->next)
+            moved += drain(r);
+        if (!moved)
+            nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * drain - write out the calls waiting in ring r. Returns how many, or
+ *     0 if another thread is already at it.
+ */
+static int drain(ring_t *r)
+{
+    unsigned long head, tail, n, first;
+
+    if (!__sync_bool_compare_and_swap(&r->busy, 0, 1))
+        return 0;
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    for (n = tail - head; head != tail; head += first) {
+        first = RING_SIZE - (head & (RING_SIZE - 1));
+        if (first > tail - head)
+            first = tail - head;
+        if (write(raw_fd, &r->ev[head & (RING_SIZE - 1)],
+                  first * sizeof(event_t)) < 0)
+            break;
+        __atomic_store_n(&r->head, head + first, __ATOMIC_RELEASE);
+    }
+    __sync_lock_release(&r->busy);
+    return n;
+}
+
+/*
+ * stop_in_child - a forked child has no writer thread, so it records
+ *     nothing, and leaves the parent's files alone
+ */
+static void stop_in_child(void)
+{
+    recording = 0;
+}
+
+/*
+ * The ids of live blocks, in a table keyed by address with linear
+ * probing. Removal shifts later entries back so no probe is cut short.
+ */
+typedef struct {
+    uint64_t ptr;       /* block address, 0 for an empty slot */
+    uint64_t id;        /* the block's id in the trace */
+} slot_t;
+
+static slot_t *table;
+static size_t table_size, table_used;
+
+static size_t slot_of(uint64_t ptr)
+{
+    size_t i = (size_t)((ptr >> 4) * 0x9e3779b97f4a7c15ULL) & (table_size - 1);
+
+    while (table[i].ptr != 0 && table[i].ptr != ptr)
+        i = (i + 1) & (table_size - 1);
+    return i;
+}
+
+static void table_put(uint64_t ptr, uint64_t id)
+{
+    slot_t *old = table;
+    size_t i, n = table_size;
+
+    if (2 * (table_used + 1) > table_size) {
+        table_size = n ? 2 * n : 1024;
+        table = real_calloc(table_size, sizeof(slot_t));
+        for (i = 0; i < n; i++)
+            if (old[i].ptr != 0)
+                table[slot_of(old[i].ptr)] = old[i];
+        real_free(old);
+    }
+    i = slot_of(ptr);
+    if (table[i].ptr == 0)
+        table_used++;
+    table[i].ptr = ptr;
+    table[i].id = id;
+}
+
+/* returns the id of ptr and forgets it, or -1 if ptr isn't live */
+static int64_t table_take(uint64_t ptr)
+{
+    size_t i, j, home;
+    int64_t id;
+
+    if (table_size == 0 || table[i = slot_of(ptr)].ptr == 0)
+        return -1;
+    id = table[i].id;
+    for (j = i; ; ) {
+        table[i].ptr = 0;
+        do {
+            j = (j + 1) & (table_size - 1);
+            if (table[j].ptr == 0) {
+                table_used--;
+                return id;
+            }
+            home = (size_t)((table[j].ptr >> 4) * 0x9e3779b97f4a7c15ULL) & (table_size - 1);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const event_t *)a)->seq, y = ((const event_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * write_trace - sort the raw calls into the order they were made and
+ *     write them out as a trace. Frees of blocks allocated before
+ *     recording started are dropped, and a realloc of one becomes an
+ *     allocation. The header's counts are only known at the end, so it
+ *     is written last, into room left for it.
+ */
+static void write_trace(void)
+{
+    struct stat st;
+    event_t *ev;
+    size_t n, i;
+    uint64_t ids = 0, ops = 0;
+    int64_t id;
+    FILE *out;
+
+    if (fstat(raw_fd, &st) < 0 || (n = st.st_size / sizeof(event_t)) == 0)
+        return;
+    ev = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, raw_fd, 0);
+    if (ev == MAP_FAILED || (out = fopen(trace_path, "w")) == NULL) {
+        fprintf(stderr, "mmrecord: can't write %s\n", trace_path);
+        return;
+    }
+    qsort(ev, n, sizeof(event_t), compare_seq);
+
+    fprintf(out, "%*s\n%*s\n%*s\n%*s\n", HDR_WIDTH, "", HDR_WIDTH, "",
+            HDR_WIDTH, "", HDR_WIDTH, "");
+    for (i = 0; i < n; i++) {
+        /*
+         * A block can't be handed out twice, so a live entry for it is
+         * stale: its free lost the race for a sequence number
+         */
+        if (ev[i].type != EV_FREE && ev[i].ptr != ev[i].old &&
+            (id = table_take(ev[i].ptr)) >= 0) {
+            fprintf(out, "f %lld\n", (long long)id);
+            ops++;
+        }
+        if (ev[i].size == 0)
+            ev[i].size = 1; /* mdriver wants a byte to check */
+
+        switch (ev[i].type) {
+        case EV_FREE:
+            if ((id = table_take(ev[i].ptr)) < 0)
+                continue;
+            fprintf(out, "f %lld\n", (long long)id);
+            break;
+        case EV_REALLOC:
+            if ((id = table_take(ev[i].old)) >= 0) {
+                table_put(ev[i].ptr, id);
+                fprintf(out, "r %lld %u\n", (long long)id, ev[i].size);
+                break;
+            }
+            /* fall through */
+        case EV_ALLOC:
+            table_put(ev[i].ptr, ids);
+            fprintf(out, "a %llu %u\n", (unsigned long long)ids++, ev[i].size);
+            break;
+        case EV_MEMALIGN:
+            table_put(ev[i].ptr, ids);
+            fprintf(out, "m %llu %u %u\n", (unsigned long long)ids++,
+                    ev[i].align, ev[i].size);
+            break;
+        }
+        ops++;
+    }
+
+    rewind(out);
+    fprintf(out, "%-*d\n%-*llu\n%-*llu\n%-*d", HDR_WIDTH, 0,
+            HDR_WIDTH, (unsigned long long)ids, HDR_WIDTH, (unsigned long long)ops,
+            HDR_WIDTH, 1);
+    fclose(out);
+    munmap(ev, st.st_size);
+    if (stalls > 0)
+        fprintf(stderr, "mmrecord: threads filled their rings %lu times\n", stalls);
+}
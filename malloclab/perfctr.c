@@ -0,0 +1,121 @@
+/*
+ * perfctr.c - Count hardware events with perf_event_open.
+ *
+ *     Each event gets a counter of its own rather than one group, so a
+ *     CPU or VM that lacks some events (or a kernel whose
+ *     perf_event_paranoid forbids them) still counts the rest. Only
+ *     user-space events of the calling thread are counted. When the
+ *     kernel has to share the hardware counters between events, the
+ *     counts are scaled up by the share of the time each one ran.
+ *     Without perf_event_open, every event is unavailable.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "perfctr.h"
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define CACHE_READ_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* How to open each event */
+static struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_NUM] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static int fds[PERF_NUM] = {-1, -1, -1, -1, -1, -1, -1};
+
+/*
+ * init_perfctr - open a disabled counter for every event that can be
+ *     counted. Returns how many could.
+ */
+int init_perfctr(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < PERF_NUM; i++) {
+	if (fds[i] >= 0)
+	    close(fds[i]);
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+    return n;
+}
+
+/*
+ * perfctr_start - zero the counters and start them
+ */
+void perfctr_start(void)
+{
+    int i;
+
+    for (i = 0; i < PERF_NUM; i++) {
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+}
+
+/*
+ * perfctr_stop - stop the counters and store their counts, scaled for
+ *     the time the kernel had them off the hardware
+ */
+void perfctr_stop(double counts[PERF_NUM])
+{
+    uint64_t val[3]; /* count, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERF_NUM; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PERF_NUM; i++) {
+	counts[i] = -1;
+	if (fds[i] < 0 || read(fds[i], val, sizeof(val)) != sizeof(val))
+	    continue;
+	if (val[2] == 0)
+	    counts[i] = 0; /* never scheduled */
+	else
+	    counts[i] = (double)val[0] * val[1] / val[2];
+    }
+}
+
+#else /* no perf_event_open */
+
+int init_perfctr(void) { return 0; }
+void perfctr_start(void) { }
+
+void perfctr_stop(double counts[PERF_NUM])
+{
+    int i;
+
+    for (i = 0; i < PERF_NUM; i++)
+	counts[i] = -1;
+}
+
+#endif
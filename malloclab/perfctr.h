@@ -0,0 +1,22 @@
+/*
+ * perfctr.h - count hardware events around a piece of code
+ */
+
+/* The events counted, in the order perfctr_stop reports them */
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,     /* L1 data cache read misses */
+    PERF_LLC_MISSES,     /* last level cache read misses */
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,    /* data TLB read misses */
+    PERF_FAULTS,         /* page faults, a software event */
+    PERF_NUM
+};
+
+/* Open a counter for each event this process may count; returns how many */
+int init_perfctr(void);
+
+/* Count from zero, then stop and store the counts, -1 where unavailable */
+void perfctr_start(void);
+void perfctr_stop(double counts[PERF_NUM]);
@@ -0,0 +1,128 @@
+/*
+ * rep2bin.c - convert a text trace (.rep) to the binary format of
+ *             trace.h, which mdriver maps instead of parsing.
+ *
+ *             usage: rep2bin <in.rep> <out.bin>
+ *
+ *             mdriver trusts a binary trace, so this is where it is
+ *             checked: every request must be well formed, the ids must
+ *             run from 0 to num_ids-1, and there must be exactly
+ *             num_ops requests.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024  /* max length of a request line */
+#define OPS_BUF 4096  /* records written to the output at a time */
+
+static void fail(char *path, long line, char *what);
+
+static char *outpath = NULL; /* removed if the input turns out to be bad */
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    tracehdr_t hdr;
+    traceop_t buf[OPS_BUF];
+    char line[MAXLINE], type;
+    unsigned index, size, align;
+    long max_index = -1, num_ops = 0, linenum = 4;
+    int n = 0, fields;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out.bin>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+
+    /* The text header: heap size, ids, requests, weight */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.byteorder = TRACE_BYTEORDER;
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+	       &hdr.num_ops, &hdr.weight) != 4 ||
+	hdr.num_ids < 0 || hdr.num_ops < 0)
+	fail(argv[1], 1, "bad header");
+
+    if ((out = fopen(argv[2], "w")) == NULL) {
+	perror(argv[2]);
+	exit(1);
+    }
+    outpath = argv[2];
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* One request per line: a id size, r id size, m id align size, f id */
+    while (fgets(line, MAXLINE, in) != NULL) {
+	if (sscanf(line, " %c", &type) != 1)
+	    continue; /* blank line */
+	linenum++;
+	if (num_ops == hdr.num_ops)
+	    fail(argv[1], linenum, "more requests than the header says");
+	memset(&buf[n], 0, sizeof(traceop_t));
+	switch (type) {
+	case 'a':
+	case 'r':
+	    fields = sscanf(line, " %c %u %u", &type, &index, &size) - 3;
+	    buf[n].type = (type == 'a') ? ALLOC : REALLOC;
+	    buf[n].size = size;
+	    break;
+	case 'm':
+	    fields = sscanf(line, " %c %u %u %u", &type, &index, &align, &size) - 4;
+	    if (fields == 0 && (align == 0 || (align & (align - 1)) != 0))
+		fail(argv[1], linenum, "bogus alignment");
+	    buf[n].type = MEMALIGN;
+	    buf[n].size = size;
+	    buf[n].align = align;
+	    break;
+	case 'f':
+	    fields = sscanf(line, " %c %u", &type, &index) - 2;
+	    buf[n].type = FREE;
+	    break;
+	default:
+	    fail(argv[1], linenum, "bogus type character");
+	}
+	if (fields != 0)
+	    fail(argv[1], linenum, "malformed request");
+	if (index >= (unsigned)hdr.num_ids)
+	    fail(argv[1], linenum, "id out of range");
+	if (type != 'f' && (long)index > max_index)
+	    max_index = index;
+	buf[n].index = index;
+
+	num_ops++;
+	if (++n == OPS_BUF) {
+	    fwrite(buf, sizeof(traceop_t), n, out);
+	    n = 0;
+	}
+    }
+    fwrite(buf, sizeof(traceop_t), n, out);
+    fclose(in);
+
+    if (num_ops != hdr.num_ops)
+	fail(argv[1], linenum, "fewer requests than the header says");
+    if (max_index != hdr.num_ids - 1)
+	fail(argv[1], linenum, "ids don't run from 0 to num_ids-1");
+    if (fclose(out) != 0) {
+	perror(argv[2]);
+	exit(1);
+    }
+    return 0;
+}
+
+/*
+ * fail - report a bad line of the input trace and give up
+ */
+static void fail(char *path, long line, char *what)
+{
+    fprintf(stderr, "%s:%ld: %s\n", path, line, what);
+    if (outpath != NULL)
+	remove(outpath);
+    exit(1);
+}
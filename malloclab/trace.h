@@ -0,0 +1,33 @@
+/*
+ * trace.h - the binary trace format, shared by mdriver and rep2bin.
+ *
+ * A binary trace is a tracehdr_t followed by num_ops traceop_t records,
+ * in the byte order of the machine that wrote it. The records are laid
+ * out exactly as mdriver replays them, so mdriver maps the file and
+ * points trace_t.ops straight at the records instead of parsing them.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC   "MMTRACE"  /* the first 8 bytes of a binary trace, NUL included */
+#define TRACE_VERSION 1          /* bumped whenever traceop_t changes */
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC, MEMALIGN} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* alignment of a memalign request */
+} traceop_t;
+
+/* The header of a binary trace, the same fields as a text trace's */
+typedef struct {
+    char magic[8];          /* TRACE_MAGIC */
+    uint32_t version;       /* TRACE_VERSION */
+    uint32_t byteorder;     /* 0x01020304 as written by the converting machine */
+    int32_t sugg_heapsize;  /* suggested heap size (unused) */
+    int32_t num_ids;        /* number of alloc/realloc ids */
+    int32_t num_ops;        /* number of records after the header */
+    int32_t weight;         /* weight for this trace (unused) */
+} tracehdr_t;
+
+#define TRACE_BYTEORDER 0x01020304
@@ -0,0 +1,447 @@
+/*
+ * tracegen.c - generate a synthetic trace for mdriver, as large as
+ *              wanted, from a few parameters: how request sizes are
+ *              distributed, in which order blocks die, how many blocks
+ *              grow by realloc, and how many live payload bytes the
+ *              trace holds at its peak.
+ *
+ *              unix> tracegen -n 10000000 -s pow:1.2 -l random -p 256m big.bin
+ *
+ *              The trace is allocated up to the peak, then kept near
+ *              it by alternating bursts of frees and allocations, and
+ *              every block left is freed at the end. Traces are written
+ *              in the binary format of trace.h unless -r asks for text.
+ *              Replaying a heap bigger than MAX_HEAP needs an mdriver
+ *              built with a bigger one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define HDR_WIDTH 12   /* width a text header's numbers are padded to */
+#define OPS_BUF 4096   /* records written to the output at a time */
+#define MAX_CHAINS 64  /* realloc chains growing at once */
+
+/* How request sizes are drawn */
+enum {SIZE_UNIFORM, SIZE_POWER, SIZE_BIMODAL};
+
+/* Which live block is freed next */
+enum {LIFE_LIFO, LIFE_FIFO, LIFE_RANDOM, LIFE_PC};
+
+/* A live block */
+typedef struct {
+    int id;
+    int size;
+} block_t;
+
+/* A block that grows by realloc, one step at a time */
+typedef struct {
+    block_t b;
+    int steps;          /* reallocs still to come */
+} chain_t;
+
+/* Parameters, from the command line */
+static long num_ops = 1000000;       /* requests in the trace */
+static int size_kind = SIZE_POWER;
+static double alpha = 1.5;           /* power-law exponent */
+static double large_frac = 0.05;     /* share of large requests (bimodal) */
+static int min_size = 8, max_size = 64 * 1024;
+static int life = LIFE_RANDOM;
+static size_t peak = 16 << 20;       /* live payload bytes to hold */
+static int burst = 64;               /* most frees or allocations in a row */
+static double chain_frac = 0.0;      /* share of allocations that grow */
+static double growth = 1.5;          /* size ratio of each growth step */
+static int chain_len = 8;            /* reallocs in a chain */
+static int text = 0;                 /* write a text trace */
+
+/* The live blocks, oldest first, in a growable ring */
+static block_t *live;
+static size_t live_cap, live_head, live_count;
+static size_t live_bytes, max_live;
+
+static chain_t chains[MAX_CHAINS];
+static int num_chains;
+
+static FILE *out;
+static traceop_t buf[OPS_BUF];
+static int buffered;
+static long ops, ids;
+static unsigned long long rng_state;
+
+static void usage(void);
+static unsigned long long rng(void);
+static double uniform(void);
+static int draw_size(void);
+static size_t parse_bytes(char *s);
+static void emit(int type, int index, int size);
+static void push_live(block_t b);
+static block_t take_live(void);
+static void alloc_block(void);
+static void grow_chain(void);
+static void flush_ops(void);
+static long room(void);
+
+int main(int argc, char **argv)
+{
+    int c, n, i, producing = 1;
+    char *arg;
+    tracehdr_t hdr;
+
+    while ((c = getopt(argc, argv, "n:s:l:p:b:g:m:M:S:rh")) != EOF) {
+        switch (c) {
+        case 'n': /* Requests in the trace */
+            num_ops = (long)atof(optarg);
+            break;
+        case 's': /* uni, pow:ALPHA, or bi:LARGE_FRACTION */
+            if (!strcmp(optarg, "uni"))
+                size_kind = SIZE_UNIFORM;
+            else if (!strncmp(optarg, "pow", 3)) {
+                size_kind = SIZE_POWER;
+                if ((arg = strchr(optarg, ':')) != NULL)
+                    alpha = atof(arg + 1);
+            }
+            else if (!strncmp(optarg, "bi", 2)) {
+                size_kind = SIZE_BIMODAL;
+                if ((arg = strchr(optarg, ':')) != NULL)
+                    large_frac = atof(arg + 1);
+            }
+            else
+                usage();
+            break;
+        case 'l': /* lifo, fifo, random or pc */
+            if (!strcmp(optarg, "lifo"))
+                life = LIFE_LIFO;
+            else if (!strcmp(optarg, "fifo"))
+                life = LIFE_FIFO;
+            else if (!strcmp(optarg, "random"))
+                life = LIFE_RANDOM;
+            else if (!strcmp(optarg, "pc"))
+                life = LIFE_PC;
+            else
+                usage();
+            break;
+        case 'p': /* Peak live payload, with an optional k, m or g */
+            peak = parse_bytes(optarg);
+            break;
+        case 'b': /* Longest burst of frees or allocations */
+            burst = atoi(optarg);
+            break;
+        case 'g': /* FRACTION[:LENGTH[:GROWTH]] of allocations that grow */
+            chain_frac = atof(optarg);
+            if ((arg = strchr(optarg, ':')) != NULL) {
+                chain_len = atoi(arg + 1);
+                if ((arg = strchr(arg + 1, ':')) != NULL)
+                    growth = atof(arg + 1);
+            }
+            break;
+        case 'm': /* Smallest request */
+            min_size = (int)parse_bytes(optarg);
+            break;
+        case 'M': /* Largest request */
+            max_size = (int)parse_bytes(optarg);
+            break;
+        case 'S': /* Random seed */
+            rng_state = strtoull(optarg, NULL, 0);
+            break;
+        case 'r': /* Text output */
+            text = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || num_ops < 2 || burst < 1 || min_size < 1 ||
+        max_size < min_size || peak == 0 || chain_len < 1 || growth <= 1.0 ||
+        num_ops > INT_MAX)
+        usage();
+    if ((out = fopen(argv[optind], "w")) == NULL) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    /* Room for the header, whose counts are only known at the end */
+    memset(&hdr, 0, sizeof(hdr));
+    if (text)
+        fprintf(out, "%*s\n%*s\n%*s\n%*s\n", HDR_WIDTH, "", HDR_WIDTH, "",
+                HDR_WIDTH, "", HDR_WIDTH, "");
+    else
+        fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /*
+     * Below the peak, allocate; at it, free a burst of blocks. Stop
+     * while there are still requests left to free every live block.
+     */
+    while (room() >= 2) {
+        if (live_bytes < peak && producing) {
+            n = (life == LIFE_PC) ? burst : 1 + rng() % burst;
+            for (i = 0; i < n && room() >= 2; i++) {
+                if (num_chains > 0 && uniform() < chain_frac)
+                    grow_chain();
+                else
+                    alloc_block();
+            }
+            producing = live_bytes < peak;
+        }
+        else {
+            n = (life == LIFE_PC) ? burst : 1 + rng() % burst;
+            for (i = 0; i < n && live_count > 0; i++)
+                emit(FREE, take_live().id, 0);
+            producing = 1;
+        }
+    }
+
+    /* Finish the chains and free everything, in lifetime order */
+    for (i = 0; i < num_chains; i++)
+        push_live(chains[i].b);
+    num_chains = 0;
+    while (live_count > 0)
+        emit(FREE, take_live().id, 0);
+    flush_ops();
+
+    rewind(out);
+    if (text)
+        fprintf(out, "%-*d\n%-*ld\n%-*ld\n%-*d", HDR_WIDTH, 0, HDR_WIDTH, ids,
+                HDR_WIDTH, ops, HDR_WIDTH, 1);
+    else {
+        memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+        hdr.version = TRACE_VERSION;
+        hdr.byteorder = TRACE_BYTEORDER;
+        hdr.num_ids = ids;
+        hdr.num_ops = ops;
+        hdr.weight = 1;
+        fwrite(&hdr, sizeof(hdr), 1, out);
+    }
+    if (fclose(out) != 0) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    fprintf(stderr, "%ld requests, %ld blocks, peak of %zu live bytes\n",
+            ops, ids, max_live);
+    return 0;
+}
+
+/*
+ * alloc_block - allocate a new block, which may start a realloc chain
+ */
+static void alloc_block(void)
+{
+    block_t b;
+
+    b.id = ids++;
+    b.size = draw_size();
+    emit(ALLOC, b.id, b.size);
+    live_bytes += b.size;
+    if (live_bytes > max_live)
+        max_live = live_bytes;
+    if (num_chains < MAX_CHAINS && uniform() < chain_frac) {
+        chains[num_chains].b = b;
+        chains[num_chains].steps = chain_len;
+        num_chains++;
+    }
+    else
+        push_live(b);
+}
+
+/*
+ * grow_chain - grow a random chain by one step, retiring it to the live
+ *     blocks when it is done or would pass max_size
+ */
+static void grow_chain(void)
+{
+    int i = rng() % num_chains;
+    chain_t *ch = &chains[i];
+    double size = ch->b.size * growth;
+
+    if (size > max_size)
+        size = max_size;
+    live_bytes += (int)size - ch->b.size;
+    if (live_bytes > max_live)
+        max_live = live_bytes;
+    ch->b.size = (int)size;
+    emit(REALLOC, ch->b.id, ch->b.size);
+    if (--ch->steps == 0 || ch->b.size == max_size) {
+        push_live(ch->b);
+        chains[i] = chains[--num_chains];
+    }
+}
+
+/*
+ * draw_size - draw a request size between min_size and max_size
+ */
+static int draw_size(void)
+{
+    double size;
+
+    switch (size_kind) {
+    case SIZE_POWER:
+        /* Pareto: small requests are common, big ones rare but heavy */
+        size = min_size * pow(1.0 - uniform(), -1.0 / alpha);
+        break;
+    case SIZE_BIMODAL:
+        /* Small objects, with a share of buffers near max_size */
+        if (uniform() < large_frac)
+            size = max_size / 2 + uniform() * (max_size / 2);
+        else
+            size = min_size + uniform() * 3 * min_size;
+        break;
+    default:
+        size = min_size + uniform() * (max_size - min_size);
+    }
+    if (size > max_size)
+        size = max_size;
+    return size < min_size ? min_size : (int)size;
+}
+
+/*
+ * push_live - add a block to the newest end of the live blocks
+ */
+static void push_live(block_t b)
+{
+    size_t i, n = live_cap;
+    block_t *old = live;
+
+    if (live_count == live_cap) {
+        live_cap = n ? 2 * n : 1024;
+        if ((live = malloc(live_cap * sizeof(block_t))) == NULL) {
+            fprintf(stderr, "tracegen: out of memory\n");
+            exit(1);
+        }
+        for (i = 0; i < live_count; i++)
+            live[i] = old[(live_head + i) % n];
+        live_head = 0;
+        free(old);
+    }
+    live[(live_head + live_count++) % live_cap] = b;
+}
+
+/*
+ * take_live - remove the block the lifetime model frees next
+ */
+static block_t take_live(void)
+{
+    block_t b;
+    size_t i;
+
+    switch (life) {
+    case LIFE_LIFO:
+        i = live_count - 1;
+        break;
+    case LIFE_RANDOM:
+        /* the newest block takes the place of the one freed */
+        i = rng() % live_count;
+        b = live[(live_head + i) % live_cap];
+        live[(live_head + i) % live_cap] = live[(live_head + live_count - 1) % live_cap];
+        live_count--;
+        live_bytes -= b.size;
+        return b;
+    default: /* FIFO and producer/consumer */
+        b = live[live_head];
+        live_head = (live_head + 1) % live_cap;
+        live_count--;
+        live_bytes -= b.size;
+        return b;
+    }
+    b = live[(live_head + i) % live_cap];
+    live_count--;
+    live_bytes -= b.size;
+    return b;
+}
+
+/*
+ * emit - append a request to the trace
+ */
+static void emit(int type, int index, int size)
+{
+    if (text) {
+        if (type == FREE)
+            fprintf(out, "f %d\n", index);
+        else
+            fprintf(out, "%c %d %d\n", type == ALLOC ? 'a' : 'r', index, size);
+    }
+    else {
+        memset(&buf[buffered], 0, sizeof(traceop_t));
+        buf[buffered].type = type;
+        buf[buffered].index = index;
+        buf[buffered].size = size;
+        if (++buffered == OPS_BUF)
+            flush_ops();
+    }
+    ops++;
+}
+
+/*
+ * room - requests left once every live block has a free
+ */
+static long room(void)
+{
+    return num_ops - ops - (long)(live_count + num_chains);
+}
+
+static void flush_ops(void)
+{
+    fwrite(buf, sizeof(traceop_t), buffered, out);
+    buffered = 0;
+}
+
+/*
+ * rng - xorshift64*, seeded with -S
+ */
+static unsigned long long rng(void)
+{
+    if (rng_state == 0)
+        rng_state = 88172645463325252ULL;
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 2685821657736338717ULL) >> 11;
+}
+
+/* returns a double in [0, 1) */
+static double uniform(void)
+{
+    return rng() / (double)(1ULL << 53);
+}
+
+/*
+ * parse_bytes - read a byte count with an optional k, m or g suffix
+ */
+static size_t parse_bytes(char *s)
+{
+    char *end;
+    double n = strtod(s, &end);
+
+    switch (*end) {
+    case 'k': case 'K': n *= 1 << 10; break;
+    case 'm': case 'M': n *= 1 << 20; break;
+    case 'g': case 'G': n *= 1 << 30; break;
+    }
+    if (n > (double)INT_MAX * 1024)
+        n = (double)INT_MAX * 1024;
+    return n < 0 ? 0 : (size_t)n;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: tracegen [-r] [-n ops] [-s size] [-l life] [-p peak] [-b burst]\n"
+            "                [-g frac[:len[:growth]]] [-m min] [-M max] [-S seed] <out>\n"
+            "Options\n"
+            "\t-n ops     Requests in the trace (default 1000000).\n"
+            "\t-s size    Request sizes: uni, pow:ALPHA (default pow:1.5)\n"
+            "\t           or bi:FRACTION of large requests.\n"
+            "\t-l life    Order blocks die in: lifo, fifo, random (default)\n"
+            "\t           or pc, producer/consumer batches of exactly burst.\n"
+            "\t-p peak    Live payload bytes to hold, e.g. 256m (default 16m).\n"
+            "\t-b burst   Most frees or allocations in a row (default 64).\n"
+            "\t-g frac    Share of allocations that grow by realloc, len times\n"
+            "\t           by a factor of growth (defaults 8 and 1.5).\n"
+            "\t-m, -M     Smallest and largest request (default 8 and 64k).\n"
+            "\t-S seed    Random seed.\n"
+            "\t-r         Write a text trace instead of a binary one.\n");
+    exit(1);
+}